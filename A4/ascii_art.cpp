@@ -11,11 +11,14 @@
 #include <fstream>
 #include <string>
 #include <map>
+#include <atomic>
 #include <chrono>
 #include <thread>
 #include <functional>
+#include <mutex>
 #include <termios.h>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -67,7 +70,7 @@ extern int MAX_NUM_TRAVELER_THREADS;
 
 // producer sleep times
 // extern const int MIN_SLEEP_TIME;
-extern int producerSleepTime;
+extern std::atomic<int> producerSleepTime;
 
 // path to the pipe
 std::string pipePath = "/tmp/my_pipe";
@@ -105,21 +108,38 @@ void print(const T& first, const Args&... rest) {
     print(rest...);
 }
 
-// base function to be reused
-void printCell() {
-    resetTextColor();  // reset color at the end of printing
-}
+//---------------------------------------------------------------------------
+//	Frame buffer for the grid
+//---------------------------------------------------------------------------
 
-// variadic template function for the magic sauce
-template <typename T, typename... Args>
-void printCell(const T& first, const Args&... rest) {
-    if constexpr (std::is_same_v<T, TextColor>) {
-        setTextColor(first);
-    } else {
-        std::cout << first;
-    }
-    printCell(rest...);
-}
+// The grid is double-buffered: each frame is rendered into curFrame and
+// compared with prevFrame, what the terminal shows now. Only cells that
+// changed are sent, each run of them after one cursor move, and a color
+// escape is only sent when the color changes. The whole frame goes out in
+// one write(2). Anything that clears the screen must call clearTerminal()
+// so the next frame is drawn in full.
+struct ScreenCell {
+	TextColor color;
+	int icon; // index into iconDirections
+
+	bool operator==(const ScreenCell& other) const {
+		return color == other.color && icon == other.icon;
+	}
+};
+
+const ScreenCell EMPTY_CELL = {TextColor::BLACK, NUM_TRAVEL_DIRECTIONS};
+const ScreenCell INKLING_CELLS[NUM_TRAV_TYPES] = {
+	{TextColor::RED, NORTH},
+	{TextColor::GREEN, NORTH},
+	{TextColor::BLUE, NORTH},
+};
+// each cell is drawn as "[x]"
+const int CELL_WIDTH = 3;
+
+static std::vector<ScreenCell> prevFrame;
+static std::vector<ScreenCell> curFrame;
+static int frameRows = 0, frameCols = 0; // 0 when prevFrame is not on screen
+static std::string frameOut;
 
 void clearTerminal() {
 	/* system specific
@@ -132,45 +152,107 @@ void clearTerminal() {
 
 	// this is easier
 	std::cout << "\033[H\033[J"; // clear the terminal screen ;)
+	frameRows = frameCols = 0;
 }
 
-//---------------------------------------------------------------------------
-//	Drawing functions
-//---------------------------------------------------------------------------
+// move the cursor to a (0-based) row and column of the terminal
+static void appendCursorMove(std::string& out, int row, int col) {
+	out += "\033[";
+	out += std::to_string(row + 1);
+	out += ';';
+	out += std::to_string(col + 1);
+	out += 'H';
+}
 
-void drawGridAndInklingsASCII(int**grid, int numRows, int numCols, std::vector<InklingInfo>& inklingList) {
-	// redraw grid
+static void appendColor(std::string& out, TextColor color) {
+	out += "\033[";
+	out += std::to_string(static_cast<int>(color));
+	out += 'm';
+}
+
+// write a whole frame to the terminal, after anything still buffered in std::cout
+static void writeFrame(const std::string& out) {
+	std::cout.flush();
+	const char* data = out.data();
+	size_t left = out.size();
+	while (left > 0) {
+		ssize_t n = write(STDOUT_FILENO, data, left);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		data += n;
+		left -= n;
+	}
+}
+
+// send the cells of curFrame that differ from prevFrame, then make it prevFrame
+static void flushFrame(int numRows, int numCols) {
+	frameOut.clear();
+	bool fullRedraw = numRows != frameRows || numCols != frameCols;
+	if (fullRedraw) {
+		frameOut += "\033[H\033[J";
+		prevFrame.assign(curFrame.size(), EMPTY_CELL);
+	}
+
+	bool colorSet = false;
+	TextColor color = TextColor::DEFAULT;
 	for (int row = 0; row < numRows; row++) {
-        for (int col = 0; col < numCols; col++) {
-			bool inklingFound = false;
-			// is there a inkling in this grid spot?
-			for (auto inkling : inklingList) {
-				if (inkling.isLive) {
-					if (row == inkling.row && col == inkling.col) {
-						// BUG high grid count: extra vertical lines, but no extra horizontal
-						switch ((int)(inkling.type)) {
-							case RED_TRAV:
-								printCell(TextColor::RED, "[", iconDirections[inkling.dir], "]");
-								inklingFound = true;
-								break;
-							case GREEN_TRAV:
-								printCell(TextColor::GREEN, "[", iconDirections[inkling.dir], "]");
-								inklingFound = true;
-								break;
-							case BLUE_TRAV:
-								printCell(TextColor::BLUE, "[", iconDirections[inkling.dir], "]");
-								inklingFound = true;
-								break;
-						}
-					}  
-				}
+		int cursorCol = -1; // cell the cursor is at, -1 if not in this row
+		for (int col = 0; col < numCols; col++) {
+			const ScreenCell& cell = curFrame[row * numCols + col];
+			if (!fullRedraw && cell == prevFrame[row * numCols + col]) {
+				continue;
 			}
-			if(!inklingFound) {
-				printCell(TextColor::BLACK, "[ ]");
+			if (cursorCol != col) {
+				appendCursorMove(frameOut, row, col * CELL_WIDTH);
 			}
-        }
-        std::cout << std::endl; // create new row
-    }
+			if (!colorSet || cell.color != color) {
+				appendColor(frameOut, cell.color);
+				color = cell.color;
+				colorSet = true;
+			}
+			frameOut += '[';
+			frameOut += iconDirections[cell.icon];
+			frameOut += ']';
+			cursorCol = col + 1;
+		}
+	}
+	if (colorSet) {
+		appendColor(frameOut, TextColor::DEFAULT);
+	}
+
+	writeFrame(frameOut);
+	prevFrame.swap(curFrame);
+	frameRows = numRows;
+	frameCols = numCols;
+}
+
+//---------------------------------------------------------------------------
+//	Drawing functions
+//---------------------------------------------------------------------------
+
+void drawGridAndInklingsASCII(const Grid& grid, std::vector<InklingInfo>& inklingList) {
+	int numRows = grid.numRows();
+	int numCols = grid.numCols();
+
+	// curFrame doubles as this frame's occupancy map: every cell starts
+	// empty and each live inkling marks its own cell, so a frame costs
+	// O(cells + inklings) instead of a search of the list for every cell
+	curFrame.assign(numRows * numCols, EMPTY_CELL);
+	for (const InklingInfo& inkling : inklingList) {
+		if (inkling.isLive
+			&& inkling.row >= 0 && inkling.row < numRows
+			&& inkling.col >= 0 && inkling.col < numCols) {
+			ScreenCell cell = INKLING_CELLS[inkling.type];
+			cell.icon = inkling.dir;
+			curFrame[inkling.row * numCols + inkling.col] = cell;
+		}
+	}
+
+	flushFrame(numRows, numCols);
 
 	//exit(1); // uncomment this to test a single grid
 }
@@ -195,10 +277,15 @@ void drawState(int numLiveThreads, int redLevel, int greenLevel, int blueLevel)
 }
 
 void updateTerminal(void) {
+    // timer threads may redraw at the same time
+    static std::mutex terminalMtx;
     try {
-        clearTerminal();
-        gridDisplayFunc();  
-        stateDisplayFunc(); 
+        std::lock_guard<std::mutex> lock(terminalMtx);
+        gridDisplayFunc();
+        // the state pane is redrawn below the grid
+        std::cout << "\033[" << (frameRows + 1) << ";1H\033[J";
+        stateDisplayFunc();
+        std::cout.flush();
     } catch (const std::exception& e) {
         std::cerr << "ERROR :/ updateTerminal :: caught exception: " << e.what() << std::endl;
     } catch (...) {
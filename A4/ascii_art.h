@@ -7,6 +7,10 @@
 #ifndef ASCII_ART_H
 #define ASCII_ART_H
 
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <new>
 #include <vector>
 #include <string>
 
@@ -69,6 +73,43 @@ struct InklingInfo {
  bool isLive;
 };
 
+// The state grid: a single block of ints in row-major order, so a whole grid
+// is one allocation and neighboring cells share cache lines. Every row
+// starts on a cache line; grid[row][col] indexes it like an int**.
+class Grid {
+public:
+	static const int CACHE_LINE = 64;
+
+	Grid() = default;
+
+	Grid(int numRows, int numCols)
+		: rows(numRows), cols(numCols) {
+		const int perLine = CACHE_LINE / sizeof(int);
+		stride = (numCols + perLine - 1) / perLine * perLine;
+		size_t bytes = size_t(numRows) * stride * sizeof(int);
+		cells.reset(static_cast<int*>(std::aligned_alloc(CACHE_LINE, bytes ? bytes : CACHE_LINE)));
+		if (!cells) {
+			throw std::bad_alloc();
+		}
+		std::fill(cells.get(), cells.get() + size_t(numRows) * stride, 0);
+	}
+
+	int* operator[](int row) { return cells.get() + size_t(row) * stride; }
+	const int* operator[](int row) const { return cells.get() + size_t(row) * stride; }
+
+	int numRows() const { return rows; }
+	int numCols() const { return cols; }
+
+private:
+	struct FreeCells {
+		void operator()(int* p) const { std::free(p); }
+	};
+
+	std::unique_ptr<int[], FreeCells> cells;
+	int rows = 0, cols = 0;
+	int stride = 0; // ints from one row to the next
+};
+
 
 //-----------------------------------------------------------------------------
 // Function prototypes
@@ -76,7 +117,7 @@ struct InklingInfo {
 
 void myEventLoop(int val);
 void initializeFrontEnd(int argc, char** argv, void (*gridCB)(void), void (*stateCB)(void));
-void drawGridAndInklingsASCII(int**grid, int numRows, int numCols, std::vector<InklingInfo>& inklingList);
+void drawGridAndInklingsASCII(const Grid& grid, std::vector<InklingInfo>& inklingList);
 void drawState(int numLiveThreads, int redLevel, int greenLevel, int blueLevel);
 void clearTerminal();
 void cleanupAndQuit(const std::string& msg);
@@ -0,0 +1,128 @@
+//
+//  bench_ink.cpp
+//
+//  Ink tank contention: threads hammer the three tanks with acquire and
+//  refill calls, as inklings and producers do, comparing the lock-free
+//  InkTank with a tank guarded by a mutex. Each thread mostly uses one
+//  color, so the threads of a color contend with each other while colors
+//  only share a cache line if the tanks do.
+//
+//  The handoff test passes ink one unit at a time from a producer to a
+//  consumer through a nearly empty tank, with the consumer either blocking
+//  in acquireWait or polling acquire with a short sleep, as a thread with
+//  no way to wait would.
+//
+//  usage: ./bench_ink [OPS_PER_THREAD]
+//
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "ink_tank.h"
+
+const int MAX_LEVEL = 50;
+
+// the tank as it would be with a plain int and a mutex per color
+struct MutexTank {
+	int level;
+	std::mutex lock;
+
+	explicit MutexTank(int initialLevel) : level(initialLevel) {}
+
+	bool acquire(int amount) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (level < amount) {
+			return false;
+		}
+		level -= amount;
+		return true;
+	}
+
+	bool refill(int amount, int maxLevel) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (level > maxLevel - amount) {
+			return false;
+		}
+		level += amount;
+		return true;
+	}
+};
+
+// returns millions of tank operations per second
+template <typename Tank>
+double run(int numThreads, long opsPerThread) {
+	Tank tanks[3] = {Tank(20), Tank(10), Tank(40)};
+	std::vector<std::thread> threads;
+
+	auto start = std::chrono::steady_clock::now();
+	for (int t = 0; t < numThreads; t++) {
+		threads.emplace_back([&, t] {
+			unsigned x = t * 2654435761U + 1;
+			for (long i = 0; i < opsPerThread; i++) {
+				x ^= x << 13;
+				x ^= x >> 17;
+				x ^= x << 5;
+				// one operation in eight goes to another color
+				Tank& tank = tanks[(x & 7) ? t % 3 : x % 3];
+				if (x & 0x100) {
+					tank.acquire(1);
+				} else {
+					tank.refill(1, MAX_LEVEL);
+				}
+			}
+		});
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return numThreads * opsPerThread / elapsed.count() / 1e6;
+}
+
+// returns the mean time from the producer starting a refill to the consumer
+// getting the ink, in microseconds
+double handoff(bool blocking, int units) {
+	InkTank tank(0);
+	std::thread consumer([&] {
+		for (int i = 0; i < units; i++) {
+			if (blocking) {
+				tank.acquireWait(1);
+			} else {
+				while (!tank.acquire(1)) {
+					usleep(100);
+				}
+			}
+		}
+	});
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < units; i++) {
+		tank.refillWait(1, 1);
+	}
+	consumer.join();
+	std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count() / units;
+}
+
+int main(int argc, char** argv) {
+	long opsPerThread = argc < 2 ? 1000000 : std::stol(argv[1]);
+
+	const int threadCounts[] = {1, 2, 4, 8, 16, 64, 256};
+	printf("%8s %14s %14s\n", "threads", "atomic Mops/s", "mutex Mops/s");
+	for (int numThreads : threadCounts) {
+		long ops = opsPerThread * 8 / (numThreads < 8 ? 8 : numThreads);
+		double atomicRate = run<InkTank>(numThreads, ops);
+		double mutexRate = run<MutexTank>(numThreads, ops);
+		printf("%8d %14.1f %14.1f\n", numThreads, atomicRate, mutexRate);
+	}
+
+	int units = opsPerThread / 100;
+	printf("\nhandoff: %.2f us/unit blocking, %.2f us/unit polling\n",
+		   handoff(true, units), handoff(false, units));
+	return 0;
+}
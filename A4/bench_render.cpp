@@ -0,0 +1,101 @@
+//
+//  bench_render.cpp
+//
+//  Frame time of drawGridAndInklingsASCII as the grid and the number of
+//  inklings grow. Every frame moves a tenth of the inklings one step, so the
+//  diff renderer always has some cells to send. Frames are written to
+//  /dev/null; results go to stderr.
+//
+//  usage: ./bench_render [FRAMES]
+//
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ascii_art.h"
+
+//---------------------------------------------------------------------------
+//  Simulation state the front end expects from main.cpp
+//---------------------------------------------------------------------------
+
+bool DRAW_COLORED_TRAVELER_HEADS = true;
+int MAX_LEVEL = 50;
+int MAX_ADD_INK = 10;
+int MAX_NUM_TRAVELER_THREADS = 0;
+int inklingSleepTime = 1000000;
+
+bool refillRedInk(int) { return true; }
+bool refillGreenInk(int) { return true; }
+bool refillBlueInk(int) { return true; }
+void slowdownProducers(void) {}
+void speedupProducers(void) {}
+
+void cleanupAndQuit(const std::string& msg) {
+	fprintf(stderr, "%s\n", msg.c_str());
+	exit(1);
+}
+
+//---------------------------------------------------------------------------
+//  Benchmark
+//---------------------------------------------------------------------------
+
+// returns the mean time of one frame in microseconds
+double timeFrames(int size, int numInklings, int numFrames) {
+	std::default_random_engine engine(size * 7919 + numInklings);
+	std::uniform_int_distribution<int> pos(0, size - 1);
+	std::uniform_int_distribution<int> dir(0, NUM_TRAVEL_DIRECTIONS - 1);
+
+	std::vector<InklingInfo> inklings;
+	for (int i = 0; i < numInklings; i++) {
+		inklings.push_back({InklingType(i % NUM_TRAV_TYPES), pos(engine), pos(engine),
+							TravelDirection(dir(engine)), true});
+	}
+
+	// the first frame is drawn in full; time the ones after it
+	Grid grid(size, size);
+	clearTerminal();
+	drawGridAndInklingsASCII(grid, inklings);
+
+	auto start = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < numFrames; frame++) {
+		for (int i = frame % 10; i < numInklings; i += 10) {
+			InklingInfo& inkling = inklings[i];
+			inkling.dir = TravelDirection(dir(engine));
+			inkling.row = (inkling.row + (inkling.dir == SOUTH) - (inkling.dir == NORTH) + size) % size;
+			inkling.col = (inkling.col + (inkling.dir == EAST) - (inkling.dir == WEST) + size) % size;
+		}
+		drawGridAndInklingsASCII(grid, inklings);
+	}
+	std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count() / numFrames;
+}
+
+int main(int argc, char** argv) {
+	int numFrames = argc < 2 ? 200 : std::stoi(argv[1]);
+
+	// send the frames to /dev/null
+	int devNull = open("/dev/null", O_WRONLY);
+	if (devNull < 0 || dup2(devNull, STDOUT_FILENO) < 0) {
+		perror("bench_render: /dev/null");
+		return 1;
+	}
+	close(devNull);
+
+	const int sizes[] = {50, 100, 200, 400};
+	const int inklingCounts[] = {10, 100, 1000, 10000};
+	fprintf(stderr, "%-10s %10s %14s\n", "grid", "inklings", "us/frame");
+	for (int size : sizes) {
+		for (int numInklings : inklingCounts) {
+			double us = timeFrames(size, numInklings, numFrames);
+			fprintf(stderr, "%4dx%-5d %10d %14.1f\n", size, size, numInklings, us);
+		}
+	}
+	return 0;
+}
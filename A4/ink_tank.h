@@ -0,0 +1,126 @@
+//
+//  ink_tank.h
+//
+
+#ifndef INK_TANK_H
+#define INK_TANK_H
+
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <mutex>
+
+// An ink tank, drained by inklings and refilled by producers. The level is
+// an atomic changed with compare-and-swap loops that never take it below
+// zero or above the maximum, so no lock is needed. Each tank starts on its
+// own cache line so threads using different colors do not slow each other
+// down.
+//
+// acquireWait and refillWait block until they can go through instead of
+// failing. Waiters sleep on a condition variable, one for inklings waiting
+// for ink and one for producers waiting for room. The mutex is only taken
+// on that slow path: a successful change takes it to notify only if some
+// thread is waiting on the other side. That state lives on the tank's next
+// cache line, away from the level. A tank must outlive every thread that
+// can still call it; close() only makes those threads stop waiting.
+struct alignas(64) InkTank {
+	std::atomic<int> level;
+
+	explicit InkTank(int initialLevel) : level(initialLevel) {}
+
+	int get() const {
+		return level.load(std::memory_order_relaxed);
+	}
+
+	// take out `amount` ink; false, leaving the tank alone, if there is not that much
+	bool acquire(int amount) {
+		if (!tryChange(-amount, INT_MAX)) {
+			return false;
+		}
+		wake(roomWaiters, roomAvailable);
+		return true;
+	}
+
+	// add `amount` ink; false, leaving the tank alone, if it would go over `maxLevel`
+	bool refill(int amount, int maxLevel) {
+		if (!tryChange(amount, maxLevel)) {
+			return false;
+		}
+		wake(inkWaiters, inkAvailable);
+		return true;
+	}
+
+	// like acquire, but wait for the ink; false if the tank was closed
+	bool acquireWait(int amount) {
+		if (!waitFor(inkWaiters, inkAvailable, -amount, INT_MAX)) {
+			return false;
+		}
+		wake(roomWaiters, roomAvailable);
+		return true;
+	}
+
+	// like refill, but wait for room; false if the tank was closed
+	bool refillWait(int amount, int maxLevel) {
+		if (!waitFor(roomWaiters, roomAvailable, amount, maxLevel)) {
+			return false;
+		}
+		wake(inkWaiters, inkAvailable);
+		return true;
+	}
+
+	// wake every waiting thread and make every acquire and refill, waiting
+	// or not, fail from now on
+	void close() {
+		std::lock_guard<std::mutex> guard(lock);
+		closed = true;
+		inkAvailable.notify_all();
+		roomAvailable.notify_all();
+	}
+
+private:
+	std::atomic<int> inkWaiters{0};
+	std::atomic<int> roomWaiters{0};
+	alignas(64) std::mutex lock;
+	std::condition_variable inkAvailable;
+	std::condition_variable roomAvailable;
+	std::atomic<bool> closed{false}; // only set with `lock` held
+
+	// add `delta` to the level if that keeps it within [0, maxLevel] and the
+	// tank is open; false, leaving it alone, otherwise. Every access is
+	// sequentially consistent: a waiter increments its counter and then loads
+	// the level, a waker changes the level and then loads the counter, and
+	// only a total order guarantees one of them sees the other's write.
+	bool tryChange(int delta, int maxLevel) {
+		if (closed.load()) {
+			return false;
+		}
+		int cur = level.load();
+		do {
+			if (cur + delta < 0 || (delta > 0 && cur > maxLevel - delta)) {
+				return false;
+			}
+		} while (!level.compare_exchange_weak(cur, cur + delta));
+		return true;
+	}
+
+	bool waitFor(std::atomic<int>& waiters, std::condition_variable& cv,
+				 int delta, int maxLevel) {
+		if (tryChange(delta, maxLevel)) {
+			return true;
+		}
+		std::unique_lock<std::mutex> guard(lock);
+		waiters.fetch_add(1);
+		cv.wait(guard, [&] { return closed || tryChange(delta, maxLevel); });
+		waiters.fetch_sub(1);
+		return !closed;
+	}
+
+	void wake(std::atomic<int>& waiters, std::condition_variable& cv) {
+		if (waiters.load() > 0) {
+			std::lock_guard<std::mutex> guard(lock);
+			cv.notify_all();
+		}
+	}
+};
+
+#endif // INK_TANK_H
@@ -20,6 +20,7 @@
  |		- 'b' --> add blue ink												|
  +-------------------------------------------------------------------------*/
 
+#include <atomic>
 #include <random>
 #include <vector>
 #include <cstdlib>
@@ -30,6 +31,7 @@
 #include <mutex>
 
 #include "ascii_art.h"
+#include "ink_tank.h"
 
 //==================================================================================
 //	Function prototypes
@@ -43,6 +45,7 @@ bool checkIfInCorner(InklingInfo* inkling);
 void redColorThreadFunc();
 void greenColorThreadFunc();
 void blueColorThreadFunc();
+void produceInk(InkTank* tank);
 bool checkEnoughInk(InklingInfo* inkling, int moveAmount);
 
 //==================================================================================
@@ -50,7 +53,7 @@ bool checkEnoughInk(InklingInfo* inkling, int moveAmount);
 //==================================================================================
 
 //	The state grid and its dimensions
-int** grid;
+Grid grid;
 int NUM_ROWS, NUM_COLS;
 
 //	the number of live threads (that haven't terminated yet)
@@ -65,12 +68,13 @@ bool DRAW_COLORED_TRAVELER_HEADS = true;
 int MAX_LEVEL = 50;
 int MAX_ADD_INK = 10;
 int REFILL_INK = 10;
-int redLevel = 20, greenLevel = 10, blueLevel = 40;
+// the tanks are never destroyed, since detached producer and inkling threads
+// may still be using them when the application exits
+InkTank& redTank = *new InkTank(20);
+InkTank& greenTank = *new InkTank(10);
+InkTank& blueTank = *new InkTank(40);
 
-// create locks for color levels
-std::mutex redLock;
-std::mutex blueLock;
-std::mutex greenLock;
+// create locks for color cells
 std::mutex blueCellLock;
 std::mutex redCellLock;
 std::mutex greenCellLock;
@@ -78,7 +82,8 @@ std::mutex greenCellLock;
 // ink producer sleep time (in microseconds)
 // [min sleep time is arbitrary]
 const int MIN_SLEEP_TIME = 30000; // 30000
-int producerSleepTime = 100000; // 100000
+// (read by the producer threads while the keyboard handler changes it)
+std::atomic<int> producerSleepTime = 100000; // 100000
 
 // inkling sleep time (in microseconds)
 int inklingSleepTime = 1000000; // 1000000
@@ -96,7 +101,7 @@ void displayGridPane(void) {
 	//
 	//	Should we synchronize this call?
 	//---------------------------------------------------------
-    drawGridAndInklingsASCII(grid, NUM_ROWS, NUM_COLS, info);
+    drawGridAndInklingsASCII(grid, info);
 }
 
 void displayStatePane(void) {
@@ -105,80 +110,42 @@ void displayStatePane(void) {
 	//
 	//	Should we synchronize this call?
 	//---------------------------------------------------------
-	drawState(numLiveThreads, redLevel, greenLevel, blueLevel);
+	drawState(numLiveThreads, redTank.get(), greenTank.get(), blueTank.get());
 }
 
 //------------------------------------------------------------------------
 //	These are the functions that would be called by a inkling thread in
 //	order to acquire red/green/blue ink to trace its trail.
-//	You *must* synchronize access to the ink levels (C++ lock and unlock)
+//	The tanks are lock-free (see ink_tank.h).
 //------------------------------------------------------------------------
-// You probably want to edit these...
 bool acquireRedInk(int theRed) {
-	bool ok = false;
-	if (redLevel >= theRed)
-	{
-		redLevel -= theRed;
-		ok = true;
-	}
-	return ok;
+	return redTank.acquire(theRed);
 }
 
 bool acquireGreenInk(int theGreen) {
-	bool ok = false;
-	if (greenLevel >= theGreen)
-	{
-		greenLevel -= theGreen;
-		ok = true;
-	}
-	return ok;
+	return greenTank.acquire(theGreen);
 }
 
 bool acquireBlueInk(int theBlue) {
-	bool ok = false;
-	if (blueLevel >= theBlue)
-	{
-		blueLevel -= theBlue;
-		ok = true;
-	}
-	return ok;
+	return blueTank.acquire(theBlue);
 }
 
 
 //------------------------------------------------------------------------
 //	These are the functions that would be called by a producer thread in
 //	order to refill the red/green/blue ink tanks.
-//	You *must* synchronize access to the ink levels (C++ lock and unlock)
+//	The tanks are lock-free (see ink_tank.h).
 //------------------------------------------------------------------------
-// You probably want to edit these...
 bool refillRedInk(int theRed) {
-	bool ok = false;
-	if (redLevel + theRed <= MAX_LEVEL)
-	{
-		redLevel += theRed;
-		ok = true;
-	}
-	return ok;
+	return redTank.refill(theRed, MAX_LEVEL);
 }
 
 bool refillGreenInk(int theGreen) {
-	bool ok = false;
-	if (greenLevel + theGreen <= MAX_LEVEL)
-	{
-		greenLevel += theGreen;
-		ok = true;
-	}
-	return ok;
+	return greenTank.refill(theGreen, MAX_LEVEL);
 }
 
 bool refillBlueInk(int theBlue) {
-	bool ok = false;
-	if (blueLevel + theBlue <= MAX_LEVEL)
-	{
-		blueLevel += theBlue;
-		ok = true;
-	}
-	return ok;
+	return blueTank.refill(theBlue, MAX_LEVEL);
 }
 
 //------------------------------------------------------------------------
@@ -228,7 +195,10 @@ int main(int argc, char** argv) {
         
         initializeApplication();
 
-        // TODO: create producer threads that check the levels of each ink
+        // producer threads that keep each ink tank topped up
+        std::thread(redColorThreadFunc).detach();
+        std::thread(greenColorThreadFunc).detach();
+        std::thread(blueColorThreadFunc).detach();
 
         
         // TODO: create threads for the inklings
@@ -262,9 +232,11 @@ void cleanupAndQuit(const std::string& msg) {
     // you may run into seg-fault and other ugly termination issues otherwise.
 	
 	// also, if you crash there, you know something is wrong in your code.
-	for (int i=0; i< NUM_ROWS; i++)
-		delete []grid[i];
-	delete []grid;
+	// wake inklings and producers blocked on a tank and stop them using it
+	redTank.close();
+	greenTank.close();
+	blueTank.close();
+	grid = Grid();
 
 	// clear the inkling list
     exit(0);
@@ -272,9 +244,7 @@ void cleanupAndQuit(const std::string& msg) {
 
 void initializeApplication(void) {
 	//	Allocate the grid
-	grid = new int*[NUM_ROWS];
-	for (int i=0; i<NUM_ROWS; i++)
-		grid[i] = new int[NUM_COLS];
+	grid = Grid(NUM_ROWS, NUM_COLS);
 	
 	//---------------------------------------------------------------
 	//	The code block below to be replaced/removed
@@ -327,22 +297,37 @@ bool checkIfInCorner(InklingInfo* inkling) {
 
 }
 
-// TODO check if you have enough ink depending on what kind of inkling you are, maybe some locks/unlocks
+// take the ink for a move from the inkling's tank, waiting until there is
+// enough; false if the application is quitting
 bool checkEnoughInk(InklingInfo* inkling, int moveAmount) {
+	switch (inkling->type) {
+		case RED_TRAV:
+			return redTank.acquireWait(moveAmount);
+		case GREEN_TRAV:
+			return greenTank.acquireWait(moveAmount);
+		case BLUE_TRAV:
+			return blueTank.acquireWait(moveAmount);
+		default:
+			return false;
+	}
+}
 
+// a producer makes REFILL_INK ink every producerSleepTime microseconds (set
+// with the '<' and '>' keys), then waits for room in the tank to pour it in
+void produceInk(InkTank* tank) {
+	do {
+		usleep(producerSleepTime);
+	} while (tank->refillWait(REFILL_INK, MAX_LEVEL));
 }
 
-// TODO thread function for a red ink producer
 void redColorThreadFunc() {
-
+	produceInk(&redTank);
 }
 
-// TODO thread function for a green ink producer
 void greenColorThreadFunc() {
-
+	produceInk(&greenTank);
 }
 
-// TODO thread function for a blue ink producer
 void blueColorThreadFunc() {
-
+	produceInk(&blueTank);
 }
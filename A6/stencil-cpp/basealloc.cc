@@ -1,64 +1,591 @@
 #define DMALLOC_DISABLE 1
 #include "dmalloc.hh"
-#include <unordered_map>
-#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <sys/mman.h>
+#include <unistd.h>
 
 
-// This file contains a base memory allocator guaranteed not to
-// overwrite freed allocations. No need to understand it.
+// This file contains a base memory allocator that does not overwrite freed
+// allocations until at least `quarantine_depth` later frees have happened.
+// No need to understand it.
 
 
-using base_allocation = std::pair<uintptr_t, size_t>;
+// Every block starts with a `base_header` recording its usable size and the
+// size last requested for it. `check` is the block's payload address xor'ed
+// with BASE_LIVE or BASE_FREE, so a stale or forged header is unlikely to
+// look valid. `next_free` links free blocks of the same size class; keeping
+// it in the header means reuse never writes to the freed payload. Blocks in
+// guard-page mode have `next_free == BASE_GUARDED` instead. `heap` is the
+// heap the block belongs to and returns to when freed.
+static constexpr uintptr_t BASE_LIVE = 0x6261736520616c6cULL;
+static constexpr uintptr_t BASE_FREE = 0x6261736520667265ULL;
+static constexpr uintptr_t BASE_GUARDED = 1;
 
-// `allocs` is a hash table mapping active pointer address to allocation size.
-// `frees` is a vector of freed allocations.
-static std::unordered_map<uintptr_t, size_t> allocs;
-static std::vector<base_allocation> frees;
-static int disabled;
+struct base_heap;
 
-static unsigned alloc_random() {
-    static uint64_t x = 8973443640547502487ULL;
-    x = x * 6364136223846793005ULL + 1ULL;
-    return x >> 32;
+struct alignas(16) base_header {
+    size_t size;
+    size_t requested;
+    uintptr_t check;
+    uintptr_t next_free;
+    base_heap* heap;
+};
+
+// Block starts are recorded in a three-level radix tree keyed by address.
+// Each leaf covers 2^12 pages with one bit per 16-byte granule. A bit stays
+// set while the base allocator owns the block, live or freed, so "is `ptr` a
+// live block?" is three loads, a bit test and a header check, and finding
+// the block that contains an interior pointer is a backward scan of the
+// bitmap.
+// Nodes come straight from mmap and are never freed, so the registry itself
+// never calls malloc.
+static constexpr int GRANULE_SHIFT = 4;
+static constexpr int PAGE_SHIFT = 12;
+static constexpr int LEVEL_BITS = 12;
+static constexpr size_t LEVEL_SIZE = size_t(1) << LEVEL_BITS;
+static constexpr size_t PAGE_WORDS = (size_t(1) << (PAGE_SHIFT - GRANULE_SHIFT)) / 64;
+
+struct radix_leaf {
+    std::atomic<uint64_t> bits[LEVEL_SIZE][PAGE_WORDS];
+};
+struct radix_mid {
+    std::atomic<radix_leaf*> leaves[LEVEL_SIZE];
+};
+static std::atomic<radix_mid*> radix_root[LEVEL_SIZE];
+static std::mutex radix_lock;       // serializes node creation
+
+// Freed blocks are kept in segregated free lists, one per size class. Classes
+// are 16-byte steps up to 64 bytes, then four sub-classes per power of two
+// (64, 80, 96, 112, 128, 160, ...). Fresh blocks are sized to a class lower
+// bound, so a block always goes back to the class it was carved for. A
+// lookup takes the first non-empty class at or above the request's class,
+// found with a bitmap scan, but never reaches more than MAX_CLASS_SKIP classes
+// up, so big blocks are not spent on tiny requests.
+static constexpr unsigned NCLASSES = 4 + 4 * (64 - 6);
+static constexpr unsigned MAX_CLASS_SKIP = 8;
+
+// Freed blocks wait in a FIFO quarantine before reaching the free lists, so
+// recently freed memory stays intact for use-after-free and double-free
+// detection. The depth comes from DMALLOC_QUARANTINE (default 256, 0 sends
+// frees straight to the free lists).
+static constexpr size_t DEFAULT_QUARANTINE_DEPTH = 256;
+static constexpr size_t MAX_QUARANTINE_DEPTH = size_t(1) << 20;
+static size_t quarantine_depth;
+
+// Guard-page mode. With DMALLOC_GUARD_THRESHOLD=N set, requests of at least
+// N bytes get their own mapping whose payload ends against a PROT_NONE page,
+// so a write running off the end faults at once instead of being found at
+// free time. Capacity is the request rounded up to 16 bytes, placed so that it
+// ends exactly at the guard page. `dmalloc` asks `base_guards` first and, for
+// guarded blocks, leaves out its trailer canary, so the caller's payload ends
+// at the guard page too when its size is a multiple of 16, and otherwise
+// within the <16 bytes of slack that keep the payload aligned. On free the payload pages are
+// returned with MADV_DONTNEED (they read back as zeros) except for the page
+// holding the first GUARD_KEEP bytes, so headers stay valid for double-free
+// detection; the mapping is unmapped when the block leaves the quarantine.
+// Guarded blocks are never reused, since a smaller request would end short
+// of the guard page.
+static constexpr size_t GUARD_KEEP = 256;
+static size_t guard_threshold;      // 0 if guard-page mode is off
+static size_t page_size;
+
+// Heaps. The allocator is split into independent heaps, each with its own
+// lock, free lists, quarantine and counters, so threads allocating at the
+// same time do not serialize on one lock. There are DMALLOC_HEAPS of them
+// (default: one per online CPU). A block returns to the heap it came from. A
+// thread freeing another heap's block pushes it onto that heap's
+// `remote_frees` stack with one CAS instead of taking the heap's lock, as in
+// mimalloc; the owner drains the stack into its quarantine on its next
+// allocation. Guarded blocks are rare and always freed under the owner's
+// lock, because their `next_free` marks them as guarded.
+//
+// A heap whose threads have all exited is orphaned, and its free lists,
+// quarantine and remote frees would sit unused. They are reclaimed two ways.
+// A new thread adopts an orphan (or an unused heap) before sharing a heap
+// round robin. And while any heap is orphaned, a thread whose own free lists
+// cannot satisfy a request drains an orphan's remote frees and takes a block
+// from its free lists before asking the system for memory. The last thread
+// to leave a heap also drains its remote frees on the way out.
+static constexpr unsigned MAX_HEAPS = 64;
+
+struct alignas(64) base_heap {
+    std::mutex lock;                // protects everything but `remote_frees`
+    uintptr_t free_lists[NCLASSES];
+    uint64_t free_list_bits[(NCLASSES + 63) / 64];
+    uintptr_t* quarantine;
+    size_t quarantine_head;
+    size_t quarantine_count;
+    // occupancy counters for fragmentation reporting
+    unsigned long long nfree_blocks;    // # blocks in quarantine + lists
+    unsigned long long free_size;       // # bytes in those blocks
+    unsigned long long slack_size;      // # live bytes beyond requests
+    unsigned nthreads;              // # live threads using this heap
+    bool used;                      // has ever had a thread
+    // blocks freed by other threads, linked through `next_free`; on its own
+    // cache line since other threads write it
+    alignas(64) std::atomic<uintptr_t> remote_frees;
+};
+
+static base_heap heaps[MAX_HEAPS];
+static unsigned nheaps;
+static std::atomic<unsigned> next_heap;
+static std::atomic<unsigned> norphans;  // # used heaps with no live threads
+static thread_local base_heap* thread_heap;
+
+// `disabled` is per thread so one thread's bookkeeping never sends another
+// to system malloc.
+static thread_local int disabled;
+
+static void* radix_node_alloc(size_t sz) {
+    void* p = mmap(nullptr, sz, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? nullptr : p;
+}
+
+static size_t root_index(uintptr_t a) {
+    return (a >> (PAGE_SHIFT + 2 * LEVEL_BITS)) & (LEVEL_SIZE - 1);
+}
+static size_t mid_index(uintptr_t a) {
+    return (a >> (PAGE_SHIFT + LEVEL_BITS)) & (LEVEL_SIZE - 1);
+}
+static size_t page_index(uintptr_t a) {
+    return (a >> PAGE_SHIFT) & (LEVEL_SIZE - 1);
+}
+static size_t granule_index(uintptr_t a) {
+    return (a & ((uintptr_t(1) << PAGE_SHIFT) - 1)) >> GRANULE_SHIFT;
+}
+
+// Returns the leaf covering `a`, creating it if `create`.
+static radix_leaf* radix_leaf_for(uintptr_t a, bool create) {
+    std::atomic<radix_mid*>& mslot = radix_root[root_index(a)];
+    radix_mid* mid = mslot.load(std::memory_order_acquire);
+    if (!mid) {
+        if (!create) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> guard(radix_lock);
+        if (!(mid = mslot.load(std::memory_order_acquire))) {
+            if (!(mid = (radix_mid*) radix_node_alloc(sizeof(radix_mid)))) {
+                return nullptr;
+            }
+            mslot.store(mid, std::memory_order_release);
+        }
+    }
+    std::atomic<radix_leaf*>& lslot = mid->leaves[mid_index(a)];
+    radix_leaf* leaf = lslot.load(std::memory_order_acquire);
+    if (!leaf) {
+        if (!create) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> guard(radix_lock);
+        if (!(leaf = lslot.load(std::memory_order_acquire))) {
+            if (!(leaf = (radix_leaf*) radix_node_alloc(sizeof(radix_leaf)))) {
+                return nullptr;
+            }
+            lslot.store(leaf, std::memory_order_release);
+        }
+    }
+    return leaf;
+}
+
+static bool radix_mark(uintptr_t a, bool live) {
+    radix_leaf* leaf = radix_leaf_for(a, true);
+    if (!leaf) {
+        return false;
+    }
+    size_t g = granule_index(a);
+    uint64_t bit = uint64_t(1) << (g % 64);
+    auto& word = leaf->bits[page_index(a)][g / 64];
+    if (live) {
+        word.fetch_or(bit, std::memory_order_release);
+    } else {
+        word.fetch_and(~bit, std::memory_order_release);
+    }
+    return true;
+}
+
+static bool radix_test(uintptr_t a) {
+    radix_leaf* leaf = radix_leaf_for(a, false);
+    if (!leaf) {
+        return false;
+    }
+    size_t g = granule_index(a);
+    return leaf->bits[page_index(a)][g / 64].load(std::memory_order_acquire)
+        & (uint64_t(1) << (g % 64));
+}
+
+// Returns the highest block start <= `a`, or 0. Only used when
+// reporting errors, so it may walk a long way.
+static uintptr_t radix_find_at_or_below(uintptr_t a) {
+    a &= ~((uintptr_t(1) << GRANULE_SHIFT) - 1);
+    while (true) {
+        // `shift` is the span of the region known to hold no live blocks if
+        // nothing is found below
+        int shift = PAGE_SHIFT + 2 * LEVEL_BITS;
+        if (radix_mid* mid = radix_root[root_index(a)].load(std::memory_order_acquire)) {
+            shift = PAGE_SHIFT + LEVEL_BITS;
+            if (radix_leaf* leaf = mid->leaves[mid_index(a)].load(std::memory_order_acquire)) {
+                shift = PAGE_SHIFT;
+                auto& words = leaf->bits[page_index(a)];
+                size_t g = granule_index(a);
+                for (size_t w = g / 64 + 1; w-- > 0; ) {
+                    uint64_t bits = words[w].load(std::memory_order_acquire);
+                    if (w == g / 64 && g % 64 != 63) {
+                        bits &= (uint64_t(1) << (g % 64 + 1)) - 1;
+                    }
+                    if (bits) {
+                        uintptr_t page = a & ~((uintptr_t(1) << PAGE_SHIFT) - 1);
+                        return page + ((w * 64 + 63 - __builtin_clzll(bits)) << GRANULE_SHIFT);
+                    }
+                }
+            }
+        }
+        uintptr_t base = a & ~((uintptr_t(1) << shift) - 1);
+        if (base == 0) {
+            return 0;
+        }
+        a = base - (uintptr_t(1) << GRANULE_SHIFT);
+    }
+}
+
+static base_header* header_of(uintptr_t payload) {
+    return reinterpret_cast<base_header*>(payload) - 1;
+}
+
+// Returns the largest class whose lower bound is <= `sz`.
+static unsigned class_floor(size_t sz) {
+    if (sz < 64) {
+        return sz / 16;
+    }
+    unsigned lg = 63 - __builtin_clzll(sz);
+    return 4 + 4 * (lg - 6) + ((sz >> (lg - 2)) & 3);
+}
+
+static size_t class_min(unsigned cls) {
+    if (cls < 4) {
+        return cls * 16;
+    }
+    unsigned lg = 6 + (cls - 4) / 4;
+    return size_t(4 + (cls - 4) % 4) << (lg - 2);
+}
+
+// Returns the smallest class all of whose blocks can hold `sz` bytes, or
+// NCLASSES if `sz` is larger than the top class bound.
+static unsigned class_ceil(size_t sz) {
+    unsigned cls = class_floor(sz);
+    return class_min(cls) < sz ? cls + 1 : cls;
+}
+
+static void free_list_push(base_heap* heap, uintptr_t ptr) {
+    base_header* h = header_of(ptr);
+    unsigned cls = class_floor(h->size);
+    h->next_free = heap->free_lists[cls];
+    heap->free_lists[cls] = ptr;
+    heap->free_list_bits[cls / 64] |= uint64_t(1) << (cls % 64);
+}
+
+// Pops a block from the first non-empty class in [lo, hi), or returns 0.
+static uintptr_t free_list_pop(base_heap* heap, unsigned lo, unsigned hi) {
+    for (unsigned w = lo / 64; w * 64 < hi; ++w) {
+        uint64_t bits = heap->free_list_bits[w];
+        if (w == lo / 64) {
+            bits &= ~uint64_t(0) << (lo % 64);
+        }
+        if (!bits) {
+            continue;
+        }
+        unsigned cls = w * 64 + __builtin_ctzll(bits);
+        if (cls >= hi) {
+            return 0;
+        }
+        uintptr_t ptr = heap->free_lists[cls];
+        heap->free_lists[cls] = header_of(ptr)->next_free;
+        if (!heap->free_lists[cls]) {
+            heap->free_list_bits[w] &= ~(uint64_t(1) << (cls % 64));
+        }
+        return ptr;
+    }
+    return 0;
+}
+
+static size_t round_up(size_t x, size_t align) {
+    return (x + align - 1) & ~(align - 1);
+}
+
+static bool is_guarded(uintptr_t ptr) {
+    return header_of(ptr)->next_free == BASE_GUARDED;
+}
+
+// Maps a guarded block of `sz` bytes and returns its payload address, or 0.
+static uintptr_t guarded_alloc(size_t sz) {
+    size_t capacity = round_up(sz, alignof(base_header));
+    size_t len = round_up(sizeof(base_header) + capacity, page_size) + page_size;
+    void* map = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    uintptr_t guard = reinterpret_cast<uintptr_t>(map) + len - page_size;
+    uintptr_t ptr = guard - capacity;
+    if (mprotect(reinterpret_cast<void*>(guard), page_size, PROT_NONE) != 0
+        || !radix_mark(ptr, true)) {
+        munmap(map, len);
+        return 0;
+    }
+    base_header* h = header_of(ptr);
+    h->size = capacity;
+    h->next_free = BASE_GUARDED;
+    return ptr;
+}
+
+// Returns the pages of a freed guarded block to the OS, keeping the page that
+// holds its headers.
+static void guarded_discard(uintptr_t ptr) {
+    uintptr_t lo = round_up(ptr + GUARD_KEEP, page_size);
+    uintptr_t hi = ptr + header_of(ptr)->size;
+    if (lo < hi) {
+        madvise(reinterpret_cast<void*>(lo), hi - lo, MADV_DONTNEED);
+    }
+}
+
+static void guarded_unmap(uintptr_t ptr) {
+    uintptr_t guard = ptr + header_of(ptr)->size;
+    uintptr_t map = (ptr - sizeof(base_header)) & ~(page_size - 1);
+    radix_mark(ptr, false);
+    munmap(reinterpret_cast<void*>(map), guard + page_size - map);
+}
+
+// Moves a block leaving the quarantine to its free list, or unmaps it if it
+// is guarded. Requires `heap->lock`.
+static void release_block(base_heap* heap, uintptr_t ptr) {
+    if (is_guarded(ptr)) {
+        --heap->nfree_blocks;
+        heap->free_size -= header_of(ptr)->size;
+        guarded_unmap(ptr);
+    } else {
+        free_list_push(heap, ptr);
+    }
+}
+
+static void guard_init() {
+    page_size = sysconf(_SC_PAGESIZE);
+    if (const char* env = getenv("DMALLOC_GUARD_THRESHOLD")) {
+        guard_threshold = strtoull(env, nullptr, 0);
+    }
+}
+
+// Each heap has its own quarantine of the configured depth.
+static void quarantine_init() {
+    quarantine_depth = DEFAULT_QUARANTINE_DEPTH;
+    if (const char* env = getenv("DMALLOC_QUARANTINE")) {
+        quarantine_depth = strtoul(env, nullptr, 0);
+    }
+    if (quarantine_depth > MAX_QUARANTINE_DEPTH) {
+        quarantine_depth = MAX_QUARANTINE_DEPTH;
+    }
+    for (unsigned i = 0; quarantine_depth && i != nheaps; ++i) {
+        heaps[i].quarantine = (uintptr_t*) radix_node_alloc(quarantine_depth * sizeof(uintptr_t));
+        if (!heaps[i].quarantine) {
+            quarantine_depth = 0;
+        }
+    }
+}
+
+// Adds a freed block to the quarantine, moving the oldest quarantined block
+// to its free list if the quarantine is full. Requires `heap->lock`.
+static void quarantine_push(base_heap* heap, uintptr_t ptr) {
+    if (quarantine_depth == 0) {
+        release_block(heap, ptr);
+        return;
+    }
+    size_t tail = (heap->quarantine_head + heap->quarantine_count) % quarantine_depth;
+    if (heap->quarantine_count == quarantine_depth) {
+        release_block(heap, heap->quarantine[heap->quarantine_head]);
+        heap->quarantine_head = (heap->quarantine_head + 1) % quarantine_depth;
+    } else {
+        ++heap->quarantine_count;
+    }
+    heap->quarantine[tail] = ptr;
+}
+
+// Accounts for the freed block `ptr` and quarantines it. Requires
+// `heap->lock`.
+static void heap_free(base_heap* heap, uintptr_t ptr) {
+    base_header* h = header_of(ptr);
+    heap->slack_size -= h->size - h->requested;
+    ++heap->nfree_blocks;
+    heap->free_size += h->size;
+    if (is_guarded(ptr)) {
+        guarded_discard(ptr);
+    }
+    quarantine_push(heap, ptr);
+}
+
+// Takes in the blocks other threads have freed to `heap`. Requires
+// `heap->lock`.
+static void drain_remote_frees(base_heap* heap) {
+    uintptr_t ptr = heap->remote_frees.exchange(0, std::memory_order_acquire);
+    while (ptr) {
+        uintptr_t next = header_of(ptr)->next_free;
+        header_of(ptr)->next_free = 0;
+        heap_free(heap, ptr);
+        ptr = next;
+    }
+}
+
+static void heaps_init() {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nheaps = ncpus > 0 ? ncpus : 1;
+    if (const char* env = getenv("DMALLOC_HEAPS")) {
+        nheaps = strtoul(env, nullptr, 0);
+    }
+    nheaps = std::max(1U, std::min(nheaps, MAX_HEAPS));
+}
+
+// Joins `heap` as one of its threads. Requires `heap->lock`.
+static void heap_join(base_heap* heap) {
+    if (heap->nthreads++ == 0 && heap->used) {
+        norphans.fetch_sub(1, std::memory_order_relaxed);
+    }
+    heap->used = true;
+}
+
+// Leaves the calling thread's heap when the thread exits.
+struct heap_exit_hook {
+    ~heap_exit_hook() {
+        base_heap* heap = thread_heap;
+        std::lock_guard<std::mutex> guard(heap->lock);
+        ++disabled;
+        if (--heap->nthreads == 0) {
+            drain_remote_frees(heap);
+            norphans.fetch_add(1, std::memory_order_relaxed);
+        }
+        --disabled;
+    }
+};
+
+// Returns the calling thread's heap, assigning one on first use: a heap no
+// live thread uses if there is one, otherwise the next heap round robin.
+static base_heap* get_heap() {
+    if (!thread_heap) {
+        base_heap* heap = nullptr;
+        for (unsigned i = 0; i != nheaps && !heap; ++i) {
+            std::lock_guard<std::mutex> guard(heaps[i].lock);
+            if (heaps[i].nthreads == 0) {
+                heap = &heaps[i];
+                heap_join(heap);
+            }
+        }
+        if (!heap) {
+            heap = &heaps[next_heap.fetch_add(1, std::memory_order_relaxed) % nheaps];
+            std::lock_guard<std::mutex> guard(heap->lock);
+            heap_join(heap);
+        }
+        thread_heap = heap;
+        static thread_local heap_exit_hook exit_hook;
+        (void) exit_hook;
+    }
+    return thread_heap;
+}
+
+// Takes a free block of class `lo` through `hi - 1` from an orphaned heap
+// other than `heap`, draining the orphan's remote frees first. Orphans whose
+// lock is busy are skipped. Returns 0 if no orphan has one.
+static uintptr_t orphan_free_list_pop(base_heap* heap, unsigned lo, unsigned hi) {
+    for (unsigned i = 0; i != nheaps; ++i) {
+        base_heap* orphan = &heaps[i];
+        if (orphan == heap || !orphan->lock.try_lock()) {
+            continue;
+        }
+        uintptr_t ptr = 0;
+        if (orphan->nthreads == 0 && orphan->used) {
+            drain_remote_frees(orphan);
+            ptr = free_list_pop(orphan, lo, hi);
+        }
+        if (ptr) {
+            --orphan->nfree_blocks;
+            orphan->free_size -= header_of(ptr)->size;
+        }
+        orphan->lock.unlock();
+        if (ptr) {
+            return ptr;
+        }
+    }
+    return 0;
 }
 
 static void base_allocator_atexit();
 
+// Reads the configuration and sets up the heaps on first use.
+static void base_init() {
+    static const bool initialized = [] {
+        ++disabled;
+        heaps_init();
+        quarantine_init();
+        guard_init();
+        atexit(base_allocator_atexit);
+        --disabled;
+        return true;
+    }();
+    (void) initialized;
+}
+
 void* base_malloc(size_t sz) {
     if (disabled) {
         return malloc(sz);
     }
+    base_init();
+    base_heap* heap = get_heap();
+    std::lock_guard<std::mutex> guard(heap->lock);
     ++disabled;
     uintptr_t ptr = 0;
+    if (heap->remote_frees.load(std::memory_order_relaxed)) {
+        drain_remote_frees(heap);
+    }
 
-    static int base_alloc_atexit_installed = 0;
-    if (!base_alloc_atexit_installed) {
-        atexit(base_allocator_atexit);
-        base_alloc_atexit_installed = 1;
-    }
-
-    // try to use a previously-freed block 75% of the time
-    unsigned r = alloc_random();
-    if (r % 4 != 0) {
-        for (unsigned ntries = 0; ntries < 10 && ntries < frees.size(); ++ntries) {
-            auto& f = frees[alloc_random() % frees.size()];
-            if (f.second >= sz) {
-                allocs.insert(f);
-                ptr = f.first;
-                f = frees.back();
-                frees.pop_back();
-                break;
+    unsigned cls = class_ceil(sz);
+    if (guard_threshold && sz >= guard_threshold) {
+        // guarded blocks always get a fresh mapping
+        if (sz <= SIZE_MAX / 2) {
+            ptr = guarded_alloc(sz);
+        }
+    } else {
+        // reuse a freed block from the smallest suitable size class, from
+        // this heap or else an orphaned one
+        if (cls < NCLASSES) {
+            unsigned hi = std::min(cls + MAX_CLASS_SKIP + 1, NCLASSES);
+            ptr = free_list_pop(heap, cls, hi);
+            if (ptr) {
+                --heap->nfree_blocks;
+                heap->free_size -= header_of(ptr)->size;
+            } else if (norphans.load(std::memory_order_relaxed)) {
+                ptr = orphan_free_list_pop(heap, cls, hi);
+            }
+        }
+        if (!ptr && sz <= SIZE_MAX - sizeof(base_header)) {
+            // need a new allocation, rounded up to its class bound
+            size_t capacity = cls < NCLASSES ? class_min(cls) : sz;
+            void* block = malloc(sizeof(base_header) + capacity);
+            if (block) {
+                base_header* h = reinterpret_cast<base_header*>(block);
+                h->size = capacity;
+                h->next_free = 0;
+                ptr = reinterpret_cast<uintptr_t>(h + 1);
+                if (!radix_mark(ptr, true)) {
+                    free(block);
+                    ptr = 0;
+                }
             }
         }
-    }
-
-    if (!ptr) {
-        // need a new allocation
-        ptr = reinterpret_cast<uintptr_t>(malloc(sz ? sz : 1));
     }
     if (ptr) {
-        allocs[reinterpret_cast<uintptr_t>(ptr)] = sz;
+        base_header* h = header_of(ptr);
+        h->requested = sz;
+        h->check = ptr ^ BASE_LIVE;
+        h->heap = heap;
+        heap->slack_size += h->size - sz;
     }
 
     --disabled;
@@ -69,14 +596,146 @@ void base_free(void* ptr) {
     if (disabled || !ptr) {
         free(ptr);
     } else {
-        // mark free if found; if not found, invalid free: silently ignore
-        ++disabled;
-        auto it = allocs.find(reinterpret_cast<uintptr_t>(ptr));
-        if (it != allocs.end()) {
-            frees.push_back(*it);
-            allocs.erase(it);
+        // mark free if live; otherwise invalid free: silently ignore. The
+        // CAS on `check` lets exactly one of two racing frees through.
+        uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+        if (!base_is_allocated(ptr)) {
+            return;
+        }
+        base_header* h = header_of(addr);
+        uintptr_t live = addr ^ BASE_LIVE;
+        if (!__atomic_compare_exchange_n(&h->check, &live, addr ^ BASE_FREE, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return;
+        }
+        base_heap* heap = h->heap;
+        if (heap == get_heap() || is_guarded(addr)) {
+            std::lock_guard<std::mutex> guard(heap->lock);
+            ++disabled;
+            heap_free(heap, addr);
+            --disabled;
+        } else {
+            uintptr_t head = heap->remote_frees.load(std::memory_order_relaxed);
+            do {
+                h->next_free = head;
+            } while (!heap->remote_frees.compare_exchange_weak(head, addr,
+                                                              std::memory_order_release,
+                                                              std::memory_order_relaxed));
+        }
+    }
+}
+
+bool base_is_allocated(const void* ptr) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    return addr % alignof(base_header) == 0
+        && radix_test(addr)
+        && header_of(addr)->check == (addr ^ BASE_LIVE);
+}
+
+bool base_is_freed(const void* ptr) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    return addr % alignof(base_header) == 0
+        && radix_test(addr)
+        && header_of(addr)->check == (addr ^ BASE_FREE);
+}
+
+void* base_find_allocation(const void* ptr, size_t* sz) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    uintptr_t start = radix_find_at_or_below(addr);
+    if (!start || header_of(start)->check != (start ^ BASE_LIVE)
+        || addr - start >= header_of(start)->size) {
+        return nullptr;
+    }
+    if (sz) {
+        *sz = header_of(start)->size;
+    }
+    return reinterpret_cast<void*>(start);
+}
+
+void* base_find_freed(const void* ptr, size_t* sz) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    uintptr_t start = radix_find_at_or_below(addr);
+    if (!start || header_of(start)->check != (start ^ BASE_FREE)
+        || addr - start >= header_of(start)->size) {
+        return nullptr;
+    }
+    if (sz) {
+        *sz = header_of(start)->size;
+    }
+    return reinterpret_cast<void*>(start);
+}
+
+bool base_guards(size_t sz) {
+    if (disabled) {
+        return false;
+    }
+    base_init();
+    return guard_threshold && sz >= guard_threshold;
+}
+
+bool base_resize(void* ptr, size_t sz) {
+    if (!base_is_allocated(ptr)) {
+        return false;
+    }
+    base_header* h = header_of(reinterpret_cast<uintptr_t>(ptr));
+    std::lock_guard<std::mutex> guard(h->heap->lock);
+    if (!base_is_allocated(ptr) || sz > h->size) {
+        return false;
+    }
+    h->heap->slack_size = h->heap->slack_size + h->requested - sz;
+    h->requested = sz;
+    return true;
+}
+
+// Locks every heap, in index order, for whole-allocator operations.
+struct all_heaps_guard {
+    all_heaps_guard() {
+        for (unsigned i = 0; i != nheaps; ++i) {
+            heaps[i].lock.lock();
+        }
+    }
+    ~all_heaps_guard() {
+        for (unsigned i = nheaps; i-- > 0; ) {
+            heaps[i].lock.unlock();
         }
+    }
+};
+
+void base_for_each_block(void (*fn)(void* ptr, size_t sz, void* arg), void* arg) {
+    all_heaps_guard guard;
+    for (size_t r = 0; r != LEVEL_SIZE; ++r) {
+        radix_mid* mid = radix_root[r].load(std::memory_order_acquire);
+        for (size_t m = 0; mid && m != LEVEL_SIZE; ++m) {
+            radix_leaf* leaf = mid->leaves[m].load(std::memory_order_acquire);
+            for (size_t p = 0; leaf && p != LEVEL_SIZE; ++p) {
+                uintptr_t page = ((((r << LEVEL_BITS) | m) << LEVEL_BITS) | p) << PAGE_SHIFT;
+                for (size_t w = 0; w != PAGE_WORDS; ++w) {
+                    uint64_t bits = leaf->bits[p][w].load(std::memory_order_relaxed);
+                    while (bits) {
+                        uintptr_t ptr = page + ((w * 64 + __builtin_ctzll(bits)) << GRANULE_SHIFT);
+                        bits &= bits - 1;
+                        base_header* h = header_of(ptr);
+                        if (h->check == (ptr ^ BASE_LIVE)) {
+                            fn(reinterpret_cast<void*>(ptr), h->size, arg);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+void base_get_statistics(dmalloc_stats* stats) {
+    stats->nfree_blocks = stats->free_size = stats->slack_size = 0;
+    for (unsigned i = 0; i != nheaps; ++i) {
+        base_heap* heap = &heaps[i];
+        std::lock_guard<std::mutex> guard(heap->lock);
+        ++disabled;
+        drain_remote_frees(heap);
         --disabled;
+        stats->nfree_blocks += heap->nfree_blocks;
+        stats->free_size += heap->free_size;
+        stats->slack_size += heap->slack_size;
     }
 }
 
@@ -86,7 +745,18 @@ void base_allocator_disable(bool d) {
 
 static void base_allocator_atexit() {
     // clean up freed memory to shut up leak detector
-    for (auto& alloc : frees) {
-        free(reinterpret_cast<void*>(alloc.first));
+    all_heaps_guard guard;
+    for (unsigned i = 0; i != nheaps; ++i) {
+        base_heap* heap = &heaps[i];
+        drain_remote_frees(heap);
+        while (heap->quarantine_count) {
+            release_block(heap, heap->quarantine[heap->quarantine_head]);
+            heap->quarantine_head = (heap->quarantine_head + 1) % quarantine_depth;
+            --heap->quarantine_count;
+        }
+        while (uintptr_t ptr = free_list_pop(heap, 0, NCLASSES)) {
+            radix_mark(ptr, false);
+            free(header_of(ptr));
+        }
     }
 }
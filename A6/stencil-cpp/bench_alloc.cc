@@ -0,0 +1,409 @@
+#define DMALLOC_DISABLE 1
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <thread>
+#include <vector>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+// Allocator microbenchmarks: dmalloc against the base allocator alone and
+// against the system allocator.
+//
+//   churn      one thread frees and reallocates 64-byte blocks in a small
+//              working set
+//   random     the same with sizes spread log-uniformly over 8 B - 8 KiB
+//   prodcons   a producer thread allocates, a consumer thread frees
+//   vector     std::vector<int> growth to 4096 elements, through
+//              dbg_allocator for dmalloc
+//   map        std::map<int, int> insertion of 4096 keys and teardown, one
+//              node per allocation, through dbg_allocator for dmalloc
+//   larson     server simulation: threads replace random blocks in arrays
+//              handed to a different thread every round, so most frees are
+//              of another thread's blocks
+//
+// Every workload runs in its own child process so peak RSS is per run.
+// Operations are allocations plus frees. One call in LATENCY_SAMPLE is
+// timed; p50 and p99 are upper bounds of power-of-two-quarter buckets and
+// include about one clock read of overhead. Set DMALLOC_* variables as for
+// any dmalloc program to measure other configurations (e.g.
+// DMALLOC_SAMPLE_RATE=65536 DMALLOC_QUARANTINE=0).
+//
+// usage: ./bench_alloc [OPS] [WORKLOAD]
+
+static constexpr unsigned LATENCY_SAMPLE = 16;
+
+struct allocator {
+    const char* name;
+    void* (*alloc)(size_t sz);
+    void (*release)(void* ptr);
+};
+
+static void* dmalloc_alloc(size_t sz) {
+    return dmalloc(sz, __FILE__, __LINE__);
+}
+static void dmalloc_release(void* ptr) {
+    dfree(ptr, __FILE__, __LINE__);
+}
+
+static const allocator allocators[] = {
+    {"dmalloc", dmalloc_alloc, dmalloc_release},
+    {"base", base_malloc, base_free},
+    {"libc", malloc, free},
+};
+
+// Latency histogram: four buckets per power of two of nanoseconds.
+struct latency {
+    static constexpr unsigned NBUCKETS = 64 * 4;
+    unsigned long long counts[NBUCKETS] = {};
+    unsigned long long n = 0;
+
+    static unsigned bucket(uint64_t ns) {
+        if (ns < 4) {
+            return ns;
+        }
+        unsigned log = 63 - __builtin_clzll(ns);
+        return log * 4 + ((ns >> (log - 2)) & 3);
+    }
+    static uint64_t bucket_limit(unsigned b) {
+        if (b < 4) {
+            return b + 1;
+        }
+        return (uint64_t(4 + b % 4 + 1) << (b / 4)) >> 2;
+    }
+    void add(uint64_t ns) {
+        ++counts[bucket(ns)];
+        ++n;
+    }
+    void merge(const latency& other) {
+        for (unsigned b = 0; b != NBUCKETS; ++b) {
+            counts[b] += other.counts[b];
+        }
+        n += other.n;
+    }
+    uint64_t quantile(double q) const {
+        unsigned long long want = q * n, seen = 0;
+        for (unsigned b = 0; b != NBUCKETS; ++b) {
+            seen += counts[b];
+            if (seen > want) {
+                return bucket_limit(b);
+            }
+        }
+        return 0;
+    }
+};
+
+static uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Per-thread measurement state.
+struct recorder {
+    latency lat;
+    unsigned long nops = 0;
+
+    void* alloc(const allocator& a, size_t sz) {
+        if (nops++ % LATENCY_SAMPLE) {
+            return a.alloc(sz);
+        }
+        uint64_t start = now_ns();
+        void* ptr = a.alloc(sz);
+        lat.add(now_ns() - start);
+        return ptr;
+    }
+    void release(const allocator& a, void* ptr) {
+        if (!ptr) {
+            return;
+        }
+        if (nops++ % LATENCY_SAMPLE) {
+            a.release(ptr);
+            return;
+        }
+        uint64_t start = now_ns();
+        a.release(ptr);
+        lat.add(now_ns() - start);
+    }
+};
+
+struct rng {
+    uint64_t x;
+    explicit rng(uint64_t seed) : x(seed * 2654435761ULL + 1) {}
+    uint64_t next() {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        return x >> 24;
+    }
+    // log-uniform over [lo, hi)
+    size_t size(size_t lo, size_t hi) {
+        unsigned lo_log = 63 - __builtin_clzll(lo), hi_log = 63 - __builtin_clzll(hi);
+        size_t base = size_t(1) << (lo_log + next() % (hi_log - lo_log));
+        return base + next() % base;
+    }
+};
+
+static void churn(const allocator& a, unsigned long ops, recorder& r) {
+    void* slots[256] = {};
+    rng g(1);
+    while (r.nops < ops) {
+        void*& slot = slots[g.next() % 256];
+        r.release(a, slot);
+        slot = r.alloc(a, 64);
+    }
+    for (void* ptr : slots) {
+        r.release(a, ptr);
+    }
+}
+
+static void random_sizes(const allocator& a, unsigned long ops, recorder& r) {
+    void* slots[1024] = {};
+    rng g(2);
+    while (r.nops < ops) {
+        void*& slot = slots[g.next() % 1024];
+        r.release(a, slot);
+        slot = r.alloc(a, g.size(8, 8192));
+    }
+    for (void* ptr : slots) {
+        r.release(a, ptr);
+    }
+}
+
+// Single-producer single-consumer ring of blocks in flight.
+static void prodcons(const allocator& a, unsigned long ops, recorder& r) {
+    static constexpr size_t RING = 1024;
+    static void* ring[RING];
+    std::atomic<size_t> head{0}, tail{0};
+    recorder consumer_rec;
+    unsigned long nblocks = ops / 2;
+    std::thread consumer([&] {
+        for (unsigned long i = 0; i != nblocks; ++i) {
+            size_t t = tail.load(std::memory_order_relaxed);
+            while (head.load(std::memory_order_acquire) == t) {
+                sched_yield();
+            }
+            consumer_rec.release(a, ring[t % RING]);
+            tail.store(t + 1, std::memory_order_release);
+        }
+    });
+    rng g(3);
+    for (unsigned long i = 0; i != nblocks; ++i) {
+        size_t h = head.load(std::memory_order_relaxed);
+        while (h - tail.load(std::memory_order_acquire) == RING) {
+            sched_yield();
+        }
+        ring[h % RING] = r.alloc(a, g.size(16, 512));
+        head.store(h + 1, std::memory_order_release);
+    }
+    consumer.join();
+    r.lat.merge(consumer_rec.lat);
+    r.nops += consumer_rec.nops;
+}
+
+static const allocator* vector_allocator;
+static recorder* vector_recorder;
+
+// Container allocator for `vector_allocator`.
+template <typename T>
+struct plain_allocator {
+    using value_type = T;
+    plain_allocator() noexcept = default;
+    template <typename U> plain_allocator(const plain_allocator<U>&) noexcept {}
+    T* allocate(size_t n) {
+        return reinterpret_cast<T*>(vector_allocator->alloc(n * sizeof(T)));
+    }
+    void deallocate(T* ptr, size_t) {
+        vector_allocator->release(ptr);
+    }
+};
+template <typename T, typename U>
+bool operator==(const plain_allocator<T>&, const plain_allocator<U>&) {
+    return true;
+}
+template <typename T, typename U>
+bool operator!=(const plain_allocator<T>&, const plain_allocator<U>&) {
+    return false;
+}
+
+// Container allocator that times calls to the allocator `Inner` like any
+// other operation.
+template <typename T, template <typename> class Inner>
+struct timed_allocator {
+    using value_type = T;
+    template <typename U> struct rebind {
+        using other = timed_allocator<U, Inner>;
+    };
+    timed_allocator() noexcept = default;
+    template <typename U> timed_allocator(const timed_allocator<U, Inner>&) noexcept {}
+    T* allocate(size_t n) {
+        recorder& r = *vector_recorder;
+        if (r.nops++ % LATENCY_SAMPLE) {
+            return Inner<T>().allocate(n);
+        }
+        uint64_t start = now_ns();
+        T* ptr = Inner<T>().allocate(n);
+        r.lat.add(now_ns() - start);
+        return ptr;
+    }
+    void deallocate(T* ptr, size_t n) {
+        recorder& r = *vector_recorder;
+        if (r.nops++ % LATENCY_SAMPLE) {
+            Inner<T>().deallocate(ptr, n);
+            return;
+        }
+        uint64_t start = now_ns();
+        Inner<T>().deallocate(ptr, n);
+        r.lat.add(now_ns() - start);
+    }
+};
+template <typename T, typename U, template <typename> class Inner>
+bool operator==(const timed_allocator<T, Inner>&, const timed_allocator<U, Inner>&) {
+    return true;
+}
+template <typename T, typename U, template <typename> class Inner>
+bool operator!=(const timed_allocator<T, Inner>&, const timed_allocator<U, Inner>&) {
+    return false;
+}
+
+template <template <typename> class Inner>
+static void vector_growth_with(unsigned long ops, recorder& r) {
+    vector_recorder = &r;
+    while (r.nops < ops) {
+        std::vector<int, timed_allocator<int, Inner>> v;
+        for (int i = 0; i != 4096; ++i) {
+            v.push_back(i);
+        }
+    }
+}
+
+static void vector_growth(const allocator& a, unsigned long ops, recorder& r) {
+    vector_allocator = &a;
+    if (a.alloc == dmalloc_alloc) {
+        vector_growth_with<dbg_allocator>(ops, r);
+    } else {
+        vector_growth_with<plain_allocator>(ops, r);
+    }
+}
+
+template <template <typename> class Inner>
+static void map_nodes_with(unsigned long ops, recorder& r) {
+    using value = std::pair<const int, int>;
+    vector_recorder = &r;
+    while (r.nops < ops) {
+        std::map<int, int, std::less<int>, timed_allocator<value, Inner>> m;
+        for (int i = 0; i != 4096; ++i) {
+            m[(i * 2654435761U) % 4096] = i;
+        }
+    }
+}
+
+static void map_nodes(const allocator& a, unsigned long ops, recorder& r) {
+    vector_allocator = &a;
+    if (a.alloc == dmalloc_alloc) {
+        map_nodes_with<dbg_allocator>(ops, r);
+    } else {
+        map_nodes_with<plain_allocator>(ops, r);
+    }
+}
+
+static void larson(const allocator& a, unsigned long ops, recorder& r) {
+    static constexpr unsigned NTHREADS = 4, NROUNDS = 10, NSLOTS = 1000;
+    static void* slots[NTHREADS][NSLOTS];
+    recorder recs[NTHREADS];
+    unsigned long per_round = ops / NTHREADS / NROUNDS;
+    for (unsigned round = 0; round != NROUNDS; ++round) {
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t != NTHREADS; ++t) {
+            threads.emplace_back([&, t] {
+                // this round's thread `t` inherits the array last used by
+                // thread `t - 1`
+                void** mine = slots[(t + round) % NTHREADS];
+                recorder& rec = recs[t];
+                rng g(round * NTHREADS + t + 4);
+                for (unsigned long i = 0; i < per_round; i += 2) {
+                    void*& slot = mine[g.next() % NSLOTS];
+                    rec.release(a, slot);
+                    slot = rec.alloc(a, g.size(16, 1024));
+                }
+            });
+        }
+        for (auto& th : threads) {
+            th.join();
+        }
+    }
+    for (unsigned t = 0; t != NTHREADS; ++t) {
+        for (void*& ptr : slots[t]) {
+            recs[t].release(a, ptr);
+            ptr = nullptr;
+        }
+        r.lat.merge(recs[t].lat);
+        r.nops += recs[t].nops;
+    }
+}
+
+struct workload {
+    const char* name;
+    void (*run)(const allocator& a, unsigned long ops, recorder& r);
+};
+
+static const workload workloads[] = {
+    {"churn", churn},
+    {"random", random_sizes},
+    {"prodcons", prodcons},
+    {"vector", vector_growth},
+    {"map", map_nodes},
+    {"larson", larson},
+};
+
+static long peak_rss_kb() {
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+// Runs `w` against `a` in a child process and prints one result row.
+static bool run_child(const workload& w, const allocator& a, unsigned long ops) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        recorder r;
+        auto start = std::chrono::steady_clock::now();
+        w.run(a, ops, r);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        printf("%-9s %-8s %12.0f %9llu %9llu %10ld\n", w.name, a.name,
+               r.nops / elapsed.count(), (unsigned long long) r.lat.quantile(0.5),
+               (unsigned long long) r.lat.quantile(0.99), peak_rss_kb());
+        fflush(stdout);
+        _exit(0);
+    }
+    int status;
+    return pid > 0 && waitpid(pid, &status, 0) == pid
+        && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char** argv) {
+    unsigned long ops = argc > 1 ? strtoul(argv[1], nullptr, 0) : 1000000;
+    const char* only = argc > 2 ? argv[2] : nullptr;
+
+    printf("%lu ops per run, 1 in %u timed\n", ops, LATENCY_SAMPLE);
+    printf("%-9s %-8s %12s %9s %9s %10s\n", "workload", "alloc", "ops/sec",
+           "p50 ns", "p99 ns", "peak KiB");
+    bool ok = true;
+    for (const workload& w : workloads) {
+        if (only && strcmp(only, w.name) != 0) {
+            continue;
+        }
+        for (const allocator& a : allocators) {
+            if (!run_child(w, a, ops)) {
+                fprintf(stderr, "bench_alloc: %s/%s failed\n", w.name, a.name);
+                ok = false;
+            }
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,59 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <initializer_list>
+// Cost of call-stack capture.
+//
+// Runs the same dmalloc/dfree churn with stack capture off and at several
+// depths. Allocations are made from a few distinct call paths a dozen
+// frames deep, so each capture walks real frames and then finds its stack
+// already interned -- the steady state of a long-running program.
+//
+// usage: ./bench_stacks [OPS]
+
+static void* slots[64];
+
+__attribute__((noinline)) static void churn_at(int levels, uint64_t& x, int path) {
+    if (levels > 0) {
+        churn_at(levels - 1, x, path);
+        asm volatile("" : : : "memory");
+        return;
+    }
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    int slot = (x >> 33) % 64;
+    free(slots[slot]);
+    slots[slot] = malloc(8 + (x >> 40) % 200 + path);
+}
+
+static double run(unsigned long ops) {
+    uint64_t x = 1;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i != ops; ++i) {
+        churn_at(12 + i % 4, x, i % 4);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    for (auto& slot : slots) {
+        free(slot);
+        slot = nullptr;
+    }
+    return elapsed.count();
+}
+
+int main(int argc, char** argv) {
+    unsigned long ops = argc > 1 ? strtoul(argv[1], nullptr, 0) : 1000000;
+    printf("%lu malloc/free pairs per row\n", ops);
+    printf("%8s %12s %14s %10s\n", "depth", "seconds", "ns/pair", "overhead");
+
+    double base = 0;
+    for (unsigned depth : {0, 4, 8, 16}) {
+        dmalloc_set_stack_depth(depth);
+        run(ops / 10);                  // warm up caches and the stack table
+        double elapsed = run(ops);
+        if (depth == 0) {
+            base = elapsed;
+        }
+        printf("%8u %12.3f %14.1f %9.1f%%\n", depth, elapsed, elapsed * 1e9 / ops,
+               100 * (elapsed - base) / base);
+    }
+}
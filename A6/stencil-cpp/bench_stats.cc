@@ -0,0 +1,130 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+// Cost of statistics collection under concurrency.
+//
+// The first three rows run the same counter updates a dmalloc/dfree pair
+// performs (count and size on alloc, count and size on free) under three
+// schemes: one mutex-guarded `dmalloc_stats` shared by all threads, shared
+// atomic counters, and per-thread cache-line-padded shards summed on read
+// (what dmalloc uses). The last row runs real dmalloc/dfree churn while a
+// separate thread polls `get_statistics` in a loop.
+//
+// usage: ./bench_stats [MAX_THREADS] [OPS_PER_THREAD]
+
+static dmalloc_stats locked_stats;
+static std::mutex locked_stats_lock;
+
+static void locked_update(size_t sz) {
+    {
+        std::lock_guard<std::mutex> guard(locked_stats_lock);
+        ++locked_stats.nactive;
+        locked_stats.active_size += sz;
+        ++locked_stats.ntotal;
+        locked_stats.total_size += sz;
+    }
+    std::lock_guard<std::mutex> guard(locked_stats_lock);
+    --locked_stats.nactive;
+    locked_stats.active_size -= sz;
+}
+
+static std::atomic<unsigned long long> shared_counters[4];
+
+static void atomic_update(size_t sz) {
+    shared_counters[0].fetch_add(1, std::memory_order_relaxed);
+    shared_counters[1].fetch_add(sz, std::memory_order_relaxed);
+    shared_counters[2].fetch_add(1, std::memory_order_relaxed);
+    shared_counters[3].fetch_add(sz, std::memory_order_relaxed);
+}
+
+struct alignas(64) shard {
+    std::atomic<unsigned long long> counters[4];
+};
+static shard shards[256];
+static thread_local unsigned shard_index;
+
+static void sharded_update(size_t sz) {
+    auto& c = shards[shard_index].counters;
+    c[0].store(c[0].load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    c[1].store(c[1].load(std::memory_order_relaxed) + sz, std::memory_order_release);
+    c[2].store(c[2].load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    c[3].store(c[3].load(std::memory_order_relaxed) + sz, std::memory_order_release);
+}
+
+static void counter_loop(void (*update)(size_t), unsigned t, unsigned long ops) {
+    shard_index = t % 256;
+    for (unsigned long i = 0; i != ops; ++i) {
+        update(8 + i % 256);
+    }
+}
+
+static void dmalloc_loop(unsigned, unsigned long ops) {
+    void* slots[16] = {};
+    for (unsigned long i = 0; i != ops; ++i) {
+        dfree(slots[i % 16], __FILE__, __LINE__);
+        slots[i % 16] = dmalloc(8 + i % 256, __FILE__, __LINE__);
+    }
+    for (int i = 0; i != 16; ++i) {
+        dfree(slots[i], __FILE__, __LINE__);
+    }
+}
+
+static double run(const char* name, unsigned nthreads, unsigned long ops,
+                  void (*body)(unsigned, unsigned long), bool poll_stats) {
+    std::atomic<bool> done{false};
+    std::thread poller;
+    if (poll_stats) {
+        poller = std::thread([&] {
+            dmalloc_stats stats;
+            while (!done.load(std::memory_order_relaxed)) {
+                get_statistics(&stats);
+            }
+        });
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t != nthreads; ++t) {
+        threads.emplace_back(body, t, ops);
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    done = true;
+    if (poller.joinable()) {
+        poller.join();
+    }
+    double rate = double(ops) * nthreads / elapsed.count();
+    printf("%-18s %8u %14.0f\n", name, nthreads, rate);
+    return rate;
+}
+
+int main(int argc, char** argv) {
+    unsigned max_threads = std::thread::hardware_concurrency();
+    if (argc > 1) {
+        max_threads = strtoul(argv[1], nullptr, 0);
+    }
+    unsigned long ops = argc > 2 ? strtoul(argv[2], nullptr, 0) : 2000000;
+    if (max_threads == 0) {
+        max_threads = 1;
+    }
+
+    printf("%-18s %8s %14s\n", "scheme", "threads", "pairs/sec");
+    for (unsigned nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        run("mutex", nthreads, ops, [] (unsigned t, unsigned long n) {
+            counter_loop(locked_update, t, n);
+        }, false);
+        run("shared atomics", nthreads, ops, [] (unsigned t, unsigned long n) {
+            counter_loop(atomic_update, t, n);
+        }, false);
+        run("sharded", nthreads, ops, [] (unsigned t, unsigned long n) {
+            counter_loop(sharded_update, t, n);
+        }, false);
+        run("dmalloc+poller", nthreads, ops / 4, dmalloc_loop, true);
+    }
+}
@@ -0,0 +1,75 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <vector>
+// Thread scaling of dmalloc/dfree.
+//
+// Each thread churns a small private working set of random-sized blocks, so
+// almost every free is followed by an allocation of a similar size on the
+// same thread -- the case the per-thread caches are meant to serve. Every
+// block is tracked by default, so a freed block reaches its bin only after
+// passing through the thread's quarantine, and allocations come from the
+// base allocator until the quarantine has filled. Compare against the shared
+// base allocator alone with `DMALLOC_TCACHE=0`.
+//
+// usage: ./bench_threads [MAX_THREADS] [OPS_PER_THREAD]
+
+static void churn(unsigned seed, unsigned long ops) {
+    const int nslots = 64;
+    void* slots[nslots] = {};
+    uint64_t x = seed * 2654435761ULL + 1;
+    for (unsigned long i = 0; i != ops; ++i) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        int slot = (x >> 33) % nslots;
+        dfree(slots[slot], __FILE__, __LINE__);
+        slots[slot] = dmalloc(8 + (x >> 40) % 500, __FILE__, __LINE__);
+    }
+    for (int i = 0; i != nslots; ++i) {
+        dfree(slots[i], __FILE__, __LINE__);
+    }
+}
+
+int main(int argc, char** argv) {
+    unsigned max_threads = std::thread::hardware_concurrency();
+    if (argc > 1) {
+        max_threads = strtoul(argv[1], nullptr, 0);
+    }
+    unsigned long ops = argc > 2 ? strtoul(argv[2], nullptr, 0) : 1000000;
+    if (max_threads == 0) {
+        max_threads = 1;
+    }
+
+    const char* env = getenv("DMALLOC_TCACHE");
+    printf("tcache %s, %lu ops per thread\n",
+           env && env[0] == '0' ? "disabled" : "enabled", ops);
+    printf("%8s %12s %14s %9s\n", "threads", "seconds", "ops/sec", "scaling");
+
+    double base_rate = 0;
+    for (unsigned nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t != nthreads; ++t) {
+            threads.emplace_back(churn, t, ops);
+        }
+        for (auto& th : threads) {
+            th.join();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        double rate = 2.0 * ops * nthreads / elapsed.count();
+        if (nthreads == 1) {
+            base_rate = rate;
+        }
+        printf("%8u %12.3f %14.0f %8.2fx\n", nthreads, elapsed.count(), rate,
+               rate / base_rate);
+    }
+
+    dmalloc_stats stats;
+    get_statistics(&stats);
+    if (stats.nactive != 0) {
+        fprintf(stderr, "bench_threads: %llu blocks still active\n", stats.nactive);
+        return 1;
+    }
+}
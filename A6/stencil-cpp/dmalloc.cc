@@ -1,7 +1,1199 @@
 #define DMALLOC_DISABLE 1
 #include "dmalloc.hh"
+#include "dmtrace.hh"
 #include <cassert>
+#include <cerrno>
+#include <cstddef>
 #include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <ctime>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Every block handed out by `dmalloc` is laid out as
+//
+//      [alloc_header][payload: `size` bytes][trailer canary]
+//
+// The header records where the block came from and links it into the active
+// list of the thread cache that allocated it. The trailer is checked at free
+// time to catch writes past the end of the payload.
+//
+// In sampling mode (DMALLOC_SAMPLE_RATE=N) only about one allocation per N
+// bytes gets that treatment. The rest are ALLOC_FAST blocks: their header
+// holds just the size and size class, they have no trailer, and they are
+// counted with per-thread counters instead of being linked into the active
+// list. They still get the registry and double-free checks in `dfree`.
+//
+// Blocks that the base allocator places against a guard page
+// (DMALLOC_GUARD_THRESHOLD) have no trailer either: the payload ends at the
+// guard page, less alignment slack, so an overrun faults at once. They are
+// never binned or resized in place.
+
+static constexpr unsigned ALLOC_ACTIVE = 0xA11C0DE5U;
+static constexpr unsigned ALLOC_FAST = 0xFA57B10CU;
+static constexpr unsigned ALLOC_FREED = 0xF4EEB10CU;
+static constexpr uint64_t TRAILER_CANARY = 0xD15EA5EDCAFEF00DULL;
+static constexpr size_t TRAILER_SIZE = sizeof(TRAILER_CANARY);
+
+struct dmalloc_cache;
+
+struct alignas(16) alloc_header {
+    size_t size;                // # bytes requested by the caller
+    const char* file;           // allocation site
+    long line;
+    alloc_header* prev;         // links in `owner`'s active list; `next` doubles
+    alloc_header* next;         // as the tcache link once the block is freed
+    dmalloc_cache* owner;       // thread cache whose active list holds us
+    unsigned magic;             // ALLOC_ACTIVE, ALLOC_FAST or ALLOC_FREED
+    unsigned epoch;             // leak checkpoint current at allocation
+    uint16_t size_class;        // tcache class of the underlying block
+    uint8_t align_shift;        // log2 alignment if over-aligned, else 0
+    bool guarded;               // ends at a guard page, so has no trailer
+    uint32_t stack;             // allocation call stack id, 0 if none
+};
+static unsigned long long block_weight(const alloc_header* h);
+
+// Size of the trailer canary of the ALLOC_ACTIVE block `h`.
+static inline size_t trailer_size(const alloc_header* h) {
+    return h->guarded ? 0 : TRAILER_SIZE;
+}
+static_assert(sizeof(alloc_header) % alignof(std::max_align_t) == 0,
+              "payloads must stay maximally aligned");
+static_assert(sizeof(alloc_header) == DMALLOC_HEADER_SIZE
+              && TRAILER_SIZE == DMALLOC_TRAILER_SIZE,
+              "dmalloc_size_class must match the block layout");
+
+// Per-thread caches (tcache). Small blocks are binned by total block size in
+// 16-byte steps; a freed block goes to the freeing thread's bin and the next
+// `dmalloc` of the same class on that thread takes it back without calling
+// into `base_malloc`. Only blocks that overflow a bin, or that are too large
+// for any class, reach the shared base allocator.
+// A freed tracked block first waits in the freeing thread's FIFO quarantine,
+// so it is not handed out again while a stale pointer to it could still be
+// caught; it enters its bin once TCACHE_QUARANTINE later tracked frees (or
+// DMALLOC_QUARANTINE, if smaller) have pushed it out. Untracked (ALLOC_FAST)
+// blocks have no such checks and go straight to their bin.
+// `dmalloc_sized` callers pass classes computed with dmalloc_size_class and
+// skip computing them per call.
+static constexpr size_t TCACHE_STEP = DMALLOC_TCACHE_STEP;
+static constexpr unsigned TCACHE_NBINS = DMALLOC_TCACHE_NBINS;
+static constexpr unsigned TCACHE_COUNT = 32;     // max blocks held per bin
+static constexpr unsigned TCACHE_QUARANTINE = 256;  // max quarantine depth
+static constexpr unsigned NO_SIZE_CLASS = DMALLOC_NO_SIZE_CLASS;
+
+// Heavy-hitter summary: a weighted Space-Saving sketch of the stream of
+// (site, bytes) allocations. It keeps HH_COUNTERS counters; a site that is
+// not monitored replaces the smallest counter and inherits its count as
+// error, so any site with more than 1/HH_COUNTERS of all bytes is always
+// present, in bounded memory.
+static constexpr unsigned HH_COUNTERS = 64;
+
+struct hh_counter {
+    const char* file;
+    long line;
+    unsigned long long bytes;       // overestimate of the site's bytes
+    unsigned long long error;       // max amount `bytes` overestimates by
+};
+
+// Statistics counters, sharded per thread. Every counter in a shard is only
+// ever written by the shard's thread, with a plain load and store instead of
+// a locked read-modify-write, and each shard sits on its own cache lines.
+// Frees are counted by the freeing thread, so `dmalloc_stats` values such as
+// `nactive` are derived on read (allocs minus frees summed over all shards)
+// and the hot path never touches another thread's lines.
+struct alignas(64) stat_shard {
+    std::atomic<unsigned long long> nalloc{0};
+    std::atomic<unsigned long long> alloc_size{0};
+    std::atomic<unsigned long long> nfree{0};
+    std::atomic<unsigned long long> free_size{0};
+    std::atomic<unsigned long long> nfail{0};
+    std::atomic<unsigned long long> fail_size{0};
+    std::atomic<unsigned long long> nsampled{0};
+    std::atomic<unsigned long long> sampled_alloc_size{0};
+    std::atomic<unsigned long long> sampled_free_size{0};
+};
+
+// Histograms (DMALLOC_HISTOGRAMS=1): request sizes, and allocation and free
+// latency in TSC cycles. Buckets are log-linear: values below 8 get their
+// own bucket and every power of two above that is split into HIST_SUB
+// equal-width buckets, so relative error is bounded by 1/HIST_SUB across the
+// whole 64-bit range. Like the statistics, each thread writes its own copy
+// and readers merge them.
+static constexpr unsigned HIST_SUB_BITS = 2;
+static constexpr unsigned HIST_SUB = 1 << HIST_SUB_BITS;
+static constexpr unsigned HIST_EXACT = 2 * HIST_SUB;
+static constexpr unsigned HIST_NBUCKETS = HIST_EXACT + (63 - HIST_SUB_BITS) * HIST_SUB;
+
+struct histogram {
+    std::atomic<unsigned long long> bucket[HIST_NBUCKETS] = {};
+};
+
+static unsigned hist_bucket(uint64_t v) {
+    if (v < HIST_EXACT) {
+        return v;
+    }
+    unsigned lg = 63 - __builtin_clzll(v);
+    return HIST_EXACT + (lg - HIST_SUB_BITS - 1) * HIST_SUB
+        + ((v >> (lg - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// Returns the smallest value in bucket `b`.
+static uint64_t hist_bucket_min(unsigned b) {
+    if (b < HIST_EXACT) {
+        return b;
+    }
+    unsigned lg = (b - HIST_EXACT) / HIST_SUB + HIST_SUB_BITS + 1;
+    return uint64_t(HIST_SUB + (b - HIST_EXACT) % HIST_SUB) << (lg - HIST_SUB_BITS);
+}
+
+// The release store pairs with the fence in `get_statistics`.
+static void stat_add(std::atomic<unsigned long long>& counter, unsigned long long delta) {
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_release);
+}
+
+struct dmalloc_cache {
+    stat_shard stats;
+    histogram size_hist;
+    histogram malloc_cycles;
+    histogram free_cycles;
+
+    std::mutex lock;                // protects `active` and the summary below
+    alloc_header* active = nullptr;
+    alloc_header* scrub_next = nullptr; // next block the scrubber will check
+    hh_counter hh[HH_COUNTERS] = {};
+    unsigned hh_used = 0;
+    unsigned hh_last = 0;           // most recently hit counter
+
+    // sampling state, owning thread only
+    size_t bytes_until_sample = 0;
+    uint64_t sample_random = 0;
+
+    // trace recording state, owning thread only; `trace_buf` holds a
+    // dmtrace_slot_header followed by `trace_used` bytes of events
+    uint32_t trace_thread = 0;
+    uint32_t trace_used = 0;
+    uint64_t trace_prev_ns = 0;
+    uintptr_t trace_prev_addr = 0;
+    alignas(8) unsigned char trace_buf[DMTRACE_SLOT_SIZE];
+
+    // bins are only ever touched by the owning thread
+    alloc_header* bins[TCACHE_NBINS] = {};
+    unsigned bin_count[TCACHE_NBINS] = {};
+    // freed tracked blocks on their way to the bins, oldest at `qhead`;
+    // owning thread only
+    alloc_header* quarantine[TCACHE_QUARANTINE] = {};
+    unsigned qhead = 0;
+    unsigned qcount = 0;
+
+    std::atomic<bool> in_use{false};
+    dmalloc_cache* next_cache = nullptr;
+};
+
+// All caches ever created, so statistics and leak reports can see blocks
+// owned by every thread. Caches are never destroyed: when a thread exits its
+// cache is flushed and parked for the next new thread to adopt, which keeps
+// the active list of exited threads visible.
+static std::atomic<dmalloc_cache*> all_caches{nullptr};
+
+static std::atomic<uintptr_t> heap_min{UINTPTR_MAX};
+static std::atomic<uintptr_t> heap_max{0};
+
+// Allocation-site table: fixed-size and open-addressed, keyed by (file
+// pointer, line), with exact per-site counters. Slots are claimed with a CAS
+// on `file`; sites that find no slot within SITE_MAX_PROBE probes are counted
+// in `overflow_site`.
+static constexpr size_t SITE_TABLE_SIZE = 4096;
+static constexpr size_t SITE_MAX_PROBE = 32;
+static constexpr uintptr_t SITE_CLAIMING = 1;
+
+struct alloc_site {
+    std::atomic<uintptr_t> file{0};     // 0 if empty, SITE_CLAIMING while filled
+    long line = 0;
+    std::atomic<unsigned long long> nalloc{0};
+    std::atomic<unsigned long long> alloc_bytes{0};
+    std::atomic<unsigned long long> nactive{0};
+    std::atomic<unsigned long long> active_bytes{0};
+};
+static alloc_site site_table[SITE_TABLE_SIZE];
+static alloc_site overflow_site;
+
+static size_t site_hash(const char* file, long line) {
+    uint64_t x = reinterpret_cast<uintptr_t>(file) ^ (uint64_t(line) * 0x9E3779B97F4A7C15ULL);
+    x ^= x >> 29;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    return (x ^ (x >> 32)) & (SITE_TABLE_SIZE - 1);
+}
+
+// Returns the site entry for (file, line), claiming one if `create`.
+// Returns `overflow_site` for sites that do not fit, and nullptr if the
+// site is unknown and `create` is false. Slots are never released, so a
+// site whose whole probe sequence is taken by other sites is an overflow
+// site whether or not `create` is set.
+static alloc_site* site_lookup(const char* file, long line, bool create) {
+    uintptr_t key = reinterpret_cast<uintptr_t>(file);
+    if (key <= SITE_CLAIMING) {
+        return &overflow_site;
+    }
+    size_t i = site_hash(file, line);
+    for (size_t probe = 0; probe != SITE_MAX_PROBE; ++probe, i = (i + 1) % SITE_TABLE_SIZE) {
+        alloc_site& site = site_table[i];
+        uintptr_t f = site.file.load(std::memory_order_acquire);
+        if (f == 0) {
+            if (!create) {
+                return nullptr;
+            }
+            if (site.file.compare_exchange_strong(f, SITE_CLAIMING)) {
+                site.line = line;
+                site.file.store(key, std::memory_order_release);
+                return &site;
+            }
+        }
+        while (f == SITE_CLAIMING) {
+            f = site.file.load(std::memory_order_acquire);
+        }
+        if (f == key && site.line == line) {
+            return &site;
+        }
+    }
+    return &overflow_site;
+}
+
+// Leak checkpoints. Every tracked block records the epoch current when it
+// was allocated; dmalloc_leak_checkpoint() starts a new one.
+static std::atomic<unsigned> leak_epoch{0};
+
+// Call stacks (DMALLOC_STACKS=depth, or dmalloc_set_stack_depth). Tracked
+// blocks record the return addresses of up to `depth` callers, found by
+// walking the frame-pointer chain, so the tree is built with
+// -fno-omit-frame-pointer. Stacks are hash-consed into a fixed table and a
+// block stores only its stack's id, so memory stays bounded no matter how
+// many blocks share a stack; stacks that find no slot within
+// STACK_MAX_PROBE probes are dropped. Addresses are only symbolized when a
+// report prints them.
+static constexpr unsigned STACK_MAX_DEPTH = 16;
+static constexpr size_t STACK_TABLE_SIZE = 16384;
+static constexpr size_t STACK_MAX_PROBE = 32;
+static constexpr uint64_t STACK_CLAIMING = 1;
+
+struct stack_entry {
+    std::atomic<uint64_t> hash{0};      // 0 if empty, STACK_CLAIMING while filled
+    unsigned depth = 0;
+    uintptr_t frames[STACK_MAX_DEPTH];
+};
+static stack_entry stack_table[STACK_TABLE_SIZE];
+
+static std::atomic<int> stack_depth_setting{-1};
+
+static unsigned stack_depth() {
+    int depth = stack_depth_setting.load(std::memory_order_relaxed);
+    if (depth < 0) {
+        const char* env = getenv("DMALLOC_STACKS");
+        depth = env ? std::min<unsigned long>(strtoul(env, nullptr, 0), STACK_MAX_DEPTH) : 0;
+        int expected = -1;
+        stack_depth_setting.compare_exchange_strong(expected, depth);
+        depth = stack_depth_setting.load(std::memory_order_relaxed);
+    }
+    return depth;
+}
+
+// Top of the current thread's stack, which bounds the frame walk.
+static uintptr_t stack_top() {
+    static thread_local uintptr_t top;
+    if (!top) {
+        pthread_attr_t attr;
+        void* addr;
+        size_t size;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+                top = reinterpret_cast<uintptr_t>(addr) + size;
+            }
+            pthread_attr_destroy(&attr);
+        }
+        if (!top) {
+            top = UINTPTR_MAX;
+        }
+    }
+    return top;
+}
+
+// Fills `frames` with up to `depth` return addresses, starting with the
+// one stored in `frame` (a frame-pointer frame: saved frame pointer, then
+// return address). Stops at the first implausible link, since code built
+// without frame pointers leaves arbitrary values in the chain.
+static unsigned walk_stack(const void* frame, uintptr_t* frames, unsigned depth) {
+    uintptr_t top = stack_top();
+    uintptr_t fp = reinterpret_cast<uintptr_t>(frame);
+    unsigned n = 0;
+    while (n != depth && fp % sizeof(uintptr_t) == 0
+           && fp < top - 2 * sizeof(uintptr_t)) {
+        const uintptr_t* f = reinterpret_cast<const uintptr_t*>(fp);
+        if (f[1] < 4096) {
+            break;
+        }
+        frames[n++] = f[1];
+        if (f[0] <= fp || f[0] - fp > (1 << 24)) {
+            break;
+        }
+        fp = f[0];
+    }
+    return n;
+}
+
+// Returns the id of the stack whose innermost frame is `frame`, interning
+// it, or 0 if stacks are off or the table has no room.
+static uint32_t capture_stack(const void* frame) {
+    unsigned depth = stack_depth();
+    if (!depth || !frame) {
+        return 0;
+    }
+    uintptr_t frames[STACK_MAX_DEPTH];
+    unsigned n = walk_stack(frame, frames, depth);
+    uint64_t hash = 0xCBF29CE484222325ULL ^ n;
+    for (unsigned i = 0; i != n; ++i) {
+        hash = (hash ^ frames[i]) * 0x100000001B3ULL;
+        hash ^= hash >> 29;
+    }
+    hash |= 2;          // never 0 or STACK_CLAIMING
+
+    size_t i = hash & (STACK_TABLE_SIZE - 1);
+    for (size_t probe = 0; probe != STACK_MAX_PROBE; ++probe, i = (i + 1) % STACK_TABLE_SIZE) {
+        stack_entry& e = stack_table[i];
+        uint64_t h = e.hash.load(std::memory_order_acquire);
+        if (h == 0) {
+            if (e.hash.compare_exchange_strong(h, STACK_CLAIMING)) {
+                e.depth = n;
+                memcpy(e.frames, frames, n * sizeof(uintptr_t));
+                e.hash.store(hash, std::memory_order_release);
+                return i + 1;
+            }
+        }
+        while (h == STACK_CLAIMING) {
+            h = e.hash.load(std::memory_order_acquire);
+        }
+        if (h == hash && e.depth == n
+            && memcmp(e.frames, frames, n * sizeof(uintptr_t)) == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// Prints stack `id` one frame per line, symbolizing with the dynamic symbol
+// table (the tree links with -rdynamic).
+static void print_stack(FILE* f, uint32_t id) {
+    if (id == 0 || id > STACK_TABLE_SIZE) {
+        return;
+    }
+    const stack_entry& e = stack_table[id - 1];
+    for (unsigned i = 0; i != e.depth; ++i) {
+        void* addr = reinterpret_cast<void*>(e.frames[i]);
+        Dl_info info;
+        bool found = dladdr(addr, &info);
+        if (found && info.dli_sname) {
+            int status;
+            char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+            fprintf(f, "    #%u %p in %s+%#lx\n", i, addr,
+                    demangled ? demangled : info.dli_sname,
+                    static_cast<unsigned long>(e.frames[i] - reinterpret_cast<uintptr_t>(info.dli_saddr)));
+            free(demangled);
+        } else if (found && info.dli_fname) {
+            fprintf(f, "    #%u %p in %s\n", i, addr, info.dli_fname);
+        } else {
+            fprintf(f, "    #%u %p\n", i, addr);
+        }
+    }
+}
+
+// Shadow memory (DMALLOC_SHADOW=1), in the style of AddressSanitizer: one
+// shadow byte per 8-byte granule of address space, in a single MAP_NORESERVE
+// reservation, so the shadow of `a` is `shadow_base[a >> 3]` and untouched
+// shadow pages cost nothing. A shadow byte of 0 means the whole granule is
+// addressable, 1-7 that only that many leading bytes are, and the SHADOW_*
+// values mark headers and alignment padding, the slack after a payload, and
+// freed payloads. dmalloc and dfree keep it current, which lets
+// dmalloc_check_range validate an access in O(len / 8) and the heap sweep
+// tell dmalloc blocks from other base allocations.
+static constexpr int SHADOW_SCALE = 3;
+static constexpr size_t SHADOW_GRANULE = size_t(1) << SHADOW_SCALE;
+static constexpr size_t SHADOW_SPAN = size_t(1) << 48;     // covered addresses
+static constexpr uint8_t SHADOW_HEADER = 0xFA;
+static constexpr uint8_t SHADOW_REDZONE = 0xFB;
+static constexpr uint8_t SHADOW_FREED = 0xFD;
+
+static uint8_t* shadow_base;
+
+static bool shadow_init() {
+    const char* env = getenv("DMALLOC_SHADOW");
+    if (!env || !env[0] || env[0] == '0') {
+        return false;
+    }
+    void* map = mmap(nullptr, SHADOW_SPAN >> SHADOW_SCALE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        perror("dmalloc: DMALLOC_SHADOW");
+        return false;
+    }
+    shadow_base = reinterpret_cast<uint8_t*>(map);
+    return true;
+}
+
+static bool use_shadow() {
+    static const bool enabled = shadow_init();
+    return enabled;
+}
+
+static uint8_t* shadow_of(uintptr_t a) {
+    return shadow_base + (a >> SHADOW_SCALE);
+}
+
+// Marks [a, a + n) with `v`. `a` must be granule-aligned; a partial last
+// granule is marked whole.
+static void shadow_poison(uintptr_t a, size_t n, uint8_t v) {
+    memset(shadow_of(a), v, (n + SHADOW_GRANULE - 1) >> SHADOW_SCALE);
+}
+
+// Marks [a, a + n) addressable. `a` must be granule-aligned.
+static void shadow_unpoison(uintptr_t a, size_t n) {
+    memset(shadow_of(a), 0, n >> SHADOW_SCALE);
+    if (n % SHADOW_GRANULE) {
+        *shadow_of(a + n) = n % SHADOW_GRANULE;
+    }
+}
+
+// Marks a freshly allocated block: everything in [block, payload) is header
+// or padding, `sz` payload bytes are addressable, and the rest up to `end`
+// is redzone.
+static void shadow_mark_block(uintptr_t block, uintptr_t payload, size_t sz, uintptr_t end) {
+    shadow_poison(block, payload - block, SHADOW_HEADER);
+    shadow_unpoison(payload, sz);
+    uintptr_t tail = (payload + sz + SHADOW_GRANULE - 1) & ~(SHADOW_GRANULE - 1);
+    if (tail < end) {
+        shadow_poison(tail, end - tail, SHADOW_REDZONE);
+    }
+}
+
+// Re-marks the payload at `payload` after an in-place resize from
+// `old_size` to `sz` bytes; `trailer` is the size of the block's canary.
+static void shadow_resize(uintptr_t payload, size_t old_size, size_t sz, size_t trailer) {
+    shadow_unpoison(payload, sz);
+    uintptr_t tail = (payload + sz + SHADOW_GRANULE - 1) & ~(SHADOW_GRANULE - 1);
+    uintptr_t end = payload + std::max(old_size, sz) + trailer;
+    if (tail < end) {
+        shadow_poison(tail, end - tail, SHADOW_REDZONE);
+    }
+}
+
+// base_malloc for dmalloc's own bookkeeping (arenas, report buffers): the
+// block may last have been a dmalloc block, so clear its shadow.
+static void* internal_alloc(size_t sz) {
+    void* ptr = base_malloc(sz);
+    if (ptr && use_shadow()) {
+        shadow_unpoison(reinterpret_cast<uintptr_t>(ptr), sz);
+    }
+    return ptr;
+}
+
+static void site_record_alloc(alloc_header* h) {
+    alloc_site* site = site_lookup(h->file, h->line, true);
+    unsigned long long bytes = block_weight(h);
+    site->nalloc.fetch_add(1, std::memory_order_relaxed);
+    site->alloc_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    site->nactive.fetch_add(1, std::memory_order_relaxed);
+    site->active_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+static void site_record_free(alloc_header* h) {
+    if (alloc_site* site = site_lookup(h->file, h->line, false)) {
+        site->nactive.fetch_sub(1, std::memory_order_relaxed);
+        site->active_bytes.fetch_sub(block_weight(h), std::memory_order_relaxed);
+    }
+}
+
+// Feeds one allocation to `cache`'s heavy-hitter summary. Requires
+// `cache->lock`.
+static void hh_record(dmalloc_cache* cache, const char* file, long line,
+                      unsigned long long bytes) {
+    hh_counter* hh = cache->hh;
+    unsigned i = cache->hh_last;
+    if (i >= cache->hh_used || hh[i].file != file || hh[i].line != line) {
+        for (i = 0; i != cache->hh_used; ++i) {
+            if (hh[i].file == file && hh[i].line == line) {
+                break;
+            }
+        }
+    }
+    if (i == cache->hh_used) {
+        if (cache->hh_used < HH_COUNTERS) {
+            hh[i] = {file, line, 0, 0};
+            ++cache->hh_used;
+        } else {
+            i = 0;
+            for (unsigned j = 1; j != HH_COUNTERS; ++j) {
+                if (hh[j].bytes < hh[i].bytes) {
+                    i = j;
+                }
+            }
+            hh[i] = {file, line, hh[i].bytes, hh[i].bytes};
+        }
+    }
+    hh[i].bytes += bytes;
+    cache->hh_last = i;
+}
+
+// DMALLOC_HISTOGRAMS=1 turns on the size and latency histograms.
+static bool use_histograms() {
+    static const bool enabled = [] {
+        const char* env = getenv("DMALLOC_HISTOGRAMS");
+        return env && env[0] && env[0] != '0';
+    }();
+    return enabled;
+}
+
+static void hist_add(histogram& hist, uint64_t v) {
+    stat_add(hist.bucket[hist_bucket(v)], 1);
+}
+
+static uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Setting DMALLOC_TCACHE=0 in the environment sends every block through the
+// base allocator.
+static bool use_tcache() {
+    static const bool enabled = [] {
+        const char* env = getenv("DMALLOC_TCACHE");
+        return !(env && env[0] == '0');
+    }();
+    return enabled;
+}
+
+// Mean number of bytes between sampled allocations, from DMALLOC_SAMPLE_RATE.
+// 0 (the default) tracks every allocation.
+static size_t sample_rate() {
+    static const size_t rate = [] {
+        const char* env = getenv("DMALLOC_SAMPLE_RATE");
+        return env ? size_t(strtoull(env, nullptr, 0)) : size_t(0);
+    }();
+    return rate;
+}
+
+// Decides whether to track this allocation in full. Sample points are a
+// Poisson process over allocated bytes, as in tcmalloc: each thread counts
+// down an exponentially distributed number of bytes, and the allocation that
+// crosses zero is sampled.
+static bool should_sample(dmalloc_cache* cache, size_t sz) {
+    size_t rate = sample_rate();
+    if (rate == 0) {
+        return true;
+    }
+    if (cache->bytes_until_sample > sz) {
+        cache->bytes_until_sample -= sz;
+        return false;
+    }
+    uint64_t& x = cache->sample_random;
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    double u = ((x >> 11) + 1) * (1.0 / 9007199254740993.0);     // (0, 1]
+    cache->bytes_until_sample = size_t(-log(u) * rate) + 1;
+    return true;
+}
+
+// Returns the number of bytes a sample of `sz` bytes stands for: `sz`
+// divided by the probability that a block of that size is sampled.
+static double sample_weight(size_t sz) {
+    size_t rate = sample_rate();
+    if (rate == 0 || sz == 0) {
+        return sz;
+    }
+    return sz / -expm1(-double(sz) / rate);
+}
+
+// Returns the estimated bytes the tracked block `h` stands for.
+static unsigned long long block_weight(const alloc_header* h) {
+    return llround(sample_weight(h->size));
+}
+
+static unsigned size_class(size_t block_size) {
+    size_t cls = (block_size + TCACHE_STEP - 1) / TCACHE_STEP - 1;
+    return cls < TCACHE_NBINS ? cls : NO_SIZE_CLASS;
+}
+
+static size_t class_size(unsigned cls) {
+    return (cls + 1) * TCACHE_STEP;
+}
+
+static void tcache_flush(dmalloc_cache* cache) {
+    for (; cache->qcount; --cache->qcount) {
+        base_free(cache->quarantine[cache->qhead]);
+        cache->qhead = (cache->qhead + 1) % TCACHE_QUARANTINE;
+    }
+    for (unsigned cls = 0; cls != TCACHE_NBINS; ++cls) {
+        while (alloc_header* h = cache->bins[cls]) {
+            cache->bins[cls] = h->next;
+            base_free(h);
+        }
+        cache->bin_count[cls] = 0;
+    }
+}
+
+static dmalloc_cache* adopt_cache() {
+    for (dmalloc_cache* c = all_caches.load(); c; c = c->next_cache) {
+        bool expected = false;
+        if (c->in_use.compare_exchange_strong(expected, true)) {
+            return c;
+        }
+    }
+    static std::atomic<uint32_t> ncaches{0};
+    // not `new`: the operator new hooks in dmalloc_new.cc call us
+    void* mem = aligned_alloc(alignof(dmalloc_cache), sizeof(dmalloc_cache));
+    if (!mem) {
+        fprintf(stderr, "dmalloc: out of memory for thread cache\n");
+        abort();
+    }
+    dmalloc_cache* c = new (mem) dmalloc_cache;
+    c->in_use = true;
+    c->sample_random = reinterpret_cast<uintptr_t>(c);
+    c->trace_thread = ncaches++;
+    c->next_cache = all_caches.load();
+    while (!all_caches.compare_exchange_weak(c->next_cache, c)) {
+    }
+    return c;
+}
+
+// Trace recording (see dmtrace.hh). DMALLOC_TRACE names the output file and
+// DMALLOC_TRACE_SIZE its ring capacity in bytes (default 64 MiB). Each event
+// costs a clock read and a few varint stores into the thread's own buffer;
+// only a full buffer touches shared state, to claim a ring slot.
+static constexpr size_t TRACE_DEFAULT_SIZE = 64 << 20;
+static constexpr size_t TRACE_SITES_SIZE = 1 << 20;
+
+static unsigned char* trace_map;
+static size_t trace_map_size;
+static uint32_t trace_nslots;
+static std::atomic<uint64_t> trace_seq{0};
+
+static bool trace_enabled();
+
+static uint64_t trace_now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static dmtrace_file_header* trace_header() {
+    return reinterpret_cast<dmtrace_file_header*>(trace_map);
+}
+
+static void trace_flush(dmalloc_cache* cache) {
+    if (!cache->trace_used) {
+        return;
+    }
+    uint64_t seq = trace_seq.fetch_add(1, std::memory_order_relaxed);
+    auto* sh = reinterpret_cast<dmtrace_slot_header*>(cache->trace_buf);
+    sh->seq = seq + 1;
+    sh->thread = cache->trace_thread;
+    sh->used = cache->trace_used;
+    memcpy(trace_map + sizeof(dmtrace_file_header) + (seq % trace_nslots) * DMTRACE_SLOT_SIZE,
+           cache->trace_buf, sizeof(dmtrace_slot_header) + cache->trace_used);
+    cache->trace_used = 0;
+}
+
+static void trace_event(dmalloc_cache* cache, dmtrace_op op, const void* ptr,
+                        size_t sz, const char* file, long line) {
+    if (sizeof(dmtrace_slot_header) + cache->trace_used + DMTRACE_MAX_EVENT
+        > DMTRACE_SLOT_SIZE) {
+        trace_flush(cache);
+    }
+    uint64_t now = trace_now();
+    if (!cache->trace_used) {
+        reinterpret_cast<dmtrace_slot_header*>(cache->trace_buf)->start_ns = now;
+        cache->trace_prev_ns = now;
+        cache->trace_prev_addr = 0;
+    }
+    unsigned char* p = cache->trace_buf + sizeof(dmtrace_slot_header) + cache->trace_used;
+    unsigned char* start = p;
+    *p++ = op;
+    p += dmtrace_put_varint(p, now - cache->trace_prev_ns);
+    if (op == DMTRACE_MALLOC) {
+        alloc_site* site = file ? site_lookup(file, line, true) : nullptr;
+        p += dmtrace_put_varint(p, sz);
+        p += dmtrace_put_varint(p, site && site != &overflow_site ? site - site_table + 1 : 0);
+    }
+    uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    p += dmtrace_put_varint(p, dmtrace_zigzag(int64_t(addr - cache->trace_prev_addr)));
+    cache->trace_prev_ns = now;
+    cache->trace_prev_addr = addr;
+    cache->trace_used += p - start;
+}
+
+// Flushes the calling thread's events and appends the site table. Runs at
+// exit, after thread-local caches have been released.
+static void trace_finish() {
+    for (dmalloc_cache* c = all_caches.load(); c; c = c->next_cache) {
+        if (!c->in_use.load()) {
+            trace_flush(c);
+        }
+    }
+    dmtrace_file_header* fh = trace_header();
+    unsigned char* out = trace_map + fh->sites_offset;
+    unsigned char* end = out + TRACE_SITES_SIZE;
+    for (size_t i = 0; i != SITE_TABLE_SIZE; ++i) {
+        uintptr_t f = site_table[i].file.load();
+        if (f <= SITE_CLAIMING) {
+            continue;
+        }
+        const char* name = reinterpret_cast<const char*>(f);
+        dmtrace_site rec = {uint32_t(i), uint32_t(strlen(name)), site_table[i].line};
+        if (size_t(end - out) < sizeof(rec) + rec.name_len) {
+            break;
+        }
+        memcpy(out, &rec, sizeof(rec));
+        memcpy(out + sizeof(rec), name, rec.name_len);
+        out += sizeof(rec) + rec.name_len;
+    }
+    fh->sites_size = out - (trace_map + fh->sites_offset);
+    msync(trace_map, trace_map_size, MS_SYNC);
+}
+
+static bool trace_open() {
+    const char* path = getenv("DMALLOC_TRACE");
+    if (!path || !*path) {
+        return false;
+    }
+    size_t ring_size = TRACE_DEFAULT_SIZE;
+    if (const char* env = getenv("DMALLOC_TRACE_SIZE")) {
+        ring_size = strtoull(env, nullptr, 0);
+    }
+    trace_nslots = std::max<size_t>(ring_size / DMTRACE_SLOT_SIZE, 1);
+    size_t sites_offset = sizeof(dmtrace_file_header) + size_t(trace_nslots) * DMTRACE_SLOT_SIZE;
+    trace_map_size = sites_offset + TRACE_SITES_SIZE;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0 || ftruncate(fd, trace_map_size) != 0) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    void* map = mmap(nullptr, trace_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return false;
+    }
+    trace_map = reinterpret_cast<unsigned char*>(map);
+    dmtrace_file_header* fh = trace_header();
+    memcpy(fh->magic, DMTRACE_MAGIC, sizeof(fh->magic));
+    fh->slot_size = DMTRACE_SLOT_SIZE;
+    fh->nslots = trace_nslots;
+    fh->sites_offset = sites_offset;
+    fh->sites_size = 0;
+    atexit(trace_finish);
+    return true;
+}
+
+static bool trace_enabled() {
+    static const bool enabled = trace_open();
+    return enabled;
+}
+
+// Binds a cache to the current thread and releases it at thread exit.
+struct thread_cache_holder {
+    dmalloc_cache* cache = nullptr;
+    ~thread_cache_holder() {
+        if (cache) {
+            tcache_flush(cache);
+            trace_flush(cache);
+            cache->in_use = false;
+        }
+    }
+};
+static thread_local thread_cache_holder this_thread_cache;
+
+static void scrubber_autostart();
+
+static dmalloc_cache* get_thread_cache() {
+    if (!this_thread_cache.cache) {
+        this_thread_cache.cache = adopt_cache();
+        scrubber_autostart();
+    }
+    return this_thread_cache.cache;
+}
+
+static void update_heap_range(uintptr_t lo, uintptr_t hi) {
+    uintptr_t cur = heap_min.load(std::memory_order_relaxed);
+    while (lo < cur && !heap_min.compare_exchange_weak(cur, lo)) {
+    }
+    cur = heap_max.load(std::memory_order_relaxed);
+    while (hi > cur && !heap_max.compare_exchange_weak(cur, hi)) {
+    }
+}
+
+static void record_failure(size_t sz) {
+    dmalloc_cache* cache = get_thread_cache();
+    stat_add(cache->stats.nfail, 1);
+    stat_add(cache->stats.fail_size, sz);
+}
+
+// Returns true if `h` is currently linked into `cache`'s active list.
+// Requires `cache->lock`.
+static bool is_linked(dmalloc_cache* cache, alloc_header* h) {
+    return (h->prev ? h->prev->next == h : cache->active == h)
+        && (!h->next || h->next->prev == h);
+}
+
+// Formats an allocation site for reports: "file:line", or the code address
+// for sites recorded by address (`dmalloc_caller`).
+const char dmalloc_caller[] = "?";
+
+struct site_name {
+    char text[512];
+    site_name(const char* file, long line) {
+        if (file == dmalloc_caller) {
+            snprintf(text, sizeof(text), "%#lx", static_cast<unsigned long>(line));
+        } else {
+            snprintf(text, sizeof(text), "%s:%ld", file ? file : "?", line);
+        }
+    }
+};
+
+// `h`, if given, is the freed block's header, whose allocation stack is
+// printed.
+[[noreturn]] static void memory_bug(const char* file, long line, void* ptr,
+                                    const char* what, const alloc_header* h = nullptr) {
+    fprintf(stderr, "MEMORY BUG: %s: invalid free of pointer %p, %s\n",
+            site_name(file, line).text, ptr, what);
+    if (h) {
+        print_stack(stderr, h->stack);
+    }
+    abort();
+}
+
+// Reports a free of a pointer that is inside the heap but not the start of an
+// active block, naming the enclosing block if there is one.
+[[noreturn]] static void bad_free(const char* file, long line, void* ptr) {
+    fprintf(stderr, "MEMORY BUG: %s: invalid free of pointer %p, not allocated\n",
+            site_name(file, line).text, ptr);
+    size_t block_size;
+    if (void* block = base_find_allocation(ptr, &block_size)) {
+        alloc_header* h = reinterpret_cast<alloc_header*>(block);
+        uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+        uintptr_t payload = reinterpret_cast<uintptr_t>(h + 1);
+        if (block_size >= sizeof(alloc_header) && h->magic == ALLOC_ACTIVE
+            && addr >= payload && addr < payload + h->size) {
+            fprintf(stderr, "%s: %p is %zu bytes inside a %zu byte region allocated here\n",
+                    site_name(h->file, h->line).text, ptr, size_t(addr - payload), h->size);
+            print_stack(stderr, h->stack);
+        }
+    }
+    abort();
+}
+
+// Over-aligned blocks. `daligned_alloc` pads the base block and places the
+// header wherever puts the payload on the requested boundary, so the header
+// is not at the start of its base block. Returns the base block whose header
+// is `h` -- live, or freed and still quarantined -- or nullptr if `h` is not
+// such a header.
+static void* aligned_block(alloc_header* h, bool freed) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(h);
+    size_t block_size;
+    void* block = freed ? base_find_freed(h, &block_size)
+        : base_find_allocation(h, &block_size);
+    if (!block || addr % alignof(alloc_header) != 0
+        || addr + sizeof(alloc_header) > reinterpret_cast<uintptr_t>(block) + block_size) {
+        return nullptr;
+    }
+    unsigned shift = h->align_shift;
+    if (shift <= __builtin_ctzll(alignof(alloc_header)) || shift >= 64
+        || (addr + sizeof(alloc_header)) % (uintptr_t(1) << shift) != 0
+        || addr - reinterpret_cast<uintptr_t>(block) >= uintptr_t(1) << shift) {
+        return nullptr;
+    }
+    return block;
+}
+
+// Returns the base block holding the valid header `h`.
+static char* block_of(alloc_header* h) {
+    void* block = h->align_shift ? aligned_block(h, false) : h;
+    return reinterpret_cast<char*>(block);
+}
+
+// Validates a pointer passed to dfree or drealloc and returns its header,
+// whose magic is ALLOC_FAST or ALLOC_ACTIVE. Reports a memory bug otherwise.
+static alloc_header* checked_header(void* ptr, const char* file, long line) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    if (addr < heap_min.load(std::memory_order_relaxed)
+        || addr > heap_max.load(std::memory_order_relaxed)) {
+        memory_bug(file, line, ptr, "not in heap");
+    }
+    // The base registry tells us whether a header really sits in front of
+    // `ptr` before we read it.
+    alloc_header* h = reinterpret_cast<alloc_header*>(ptr) - 1;
+    if (!base_is_allocated(h) && !aligned_block(h, false)) {
+        if (base_is_freed(h) || (aligned_block(h, true) && h->magic == ALLOC_FREED)) {
+            memory_bug(file, line, ptr, "double free", h);
+        }
+        bad_free(file, line, ptr);
+    } else if (h->magic == ALLOC_FREED) {
+        memory_bug(file, line, ptr, "double free", h);
+    } else if (h->magic != ALLOC_FAST && h->magic != ALLOC_ACTIVE) {
+        bad_free(file, line, ptr);
+    }
+    return h;
+}
+
+// Checks that the ALLOC_ACTIVE block `h` is on its owner's active list and
+// that its trailer canary is intact. `guard` holds the owner's lock.
+static void check_tracked(std::unique_lock<std::mutex>& guard, alloc_header* h,
+                          const char* op, const char* file, long line) {
+    void* ptr = h + 1;
+    if (!is_linked(h->owner, h)) {
+        guard.unlock();
+        bad_free(file, line, ptr);
+    }
+    if (memcmp(reinterpret_cast<char*>(ptr) + h->size, &TRAILER_CANARY,
+               trailer_size(h)) != 0) {
+        fprintf(stderr, "MEMORY BUG: %s: detected wild write during %s of pointer %p\n",
+                site_name(file, line).text, op, ptr);
+        print_stack(stderr, h->stack);
+        abort();
+    }
+}
+
+// Depth of the per-thread quarantine of tracked blocks: DMALLOC_QUARANTINE,
+// as for the base allocator, but at most TCACHE_QUARANTINE.
+static unsigned tcache_quarantine_depth() {
+    static const unsigned depth = [] {
+        const char* env = getenv("DMALLOC_QUARANTINE");
+        unsigned long n = env ? strtoul(env, nullptr, 0) : TCACHE_QUARANTINE;
+        return unsigned(std::min(n, (unsigned long) TCACHE_QUARANTINE));
+    }();
+    return depth;
+}
+
+// Freed blocks go to the freeing thread's cache, like glibc's tcache;
+// `tracked` blocks pass through its quarantine first. Blocks with no class,
+// or whose bin is full, go to the base allocator.
+static void recycle_block(dmalloc_cache* cache, alloc_header* h, bool tracked) {
+    if (h->size_class == NO_SIZE_CLASS) {
+        base_free(block_of(h));
+        return;
+    }
+    if (tracked && tcache_quarantine_depth()) {
+        alloc_header* oldest = nullptr;
+        if (cache->qcount == tcache_quarantine_depth()) {
+            oldest = cache->quarantine[cache->qhead];
+            cache->qhead = (cache->qhead + 1) % TCACHE_QUARANTINE;
+            --cache->qcount;
+        }
+        cache->quarantine[(cache->qhead + cache->qcount) % TCACHE_QUARANTINE] = h;
+        ++cache->qcount;
+        if (!oldest) {
+            return;
+        }
+        h = oldest;
+    }
+    unsigned cls = h->size_class;
+    if (cache->bin_count[cls] < TCACHE_COUNT) {
+        h->next = cache->bins[cls];
+        cache->bins[cls] = h;
+        ++cache->bin_count[cls];
+    } else {
+        base_free(h);
+    }
+}
+
+// Arenas. An arena owns a list of chunks taken straight from `base_malloc`
+// and hands out memory by bumping a pointer through the current chunk.
+// Objects are never freed one by one; `darena_reset` and `darena_destroy`
+// count them all as freed at once. The leak report shows one line per
+// arena instead of one per object, naming its last reset, followed by one
+// line per chunk naming the `darena_alloc` call that added it. An arena left
+// with no objects after a reset is listed as undestroyed, and the leak
+// summary skips it.
+static constexpr size_t ARENA_CHUNK_SIZE = 64 << 10;
+static constexpr size_t ARENA_ALIGN = alignof(std::max_align_t);
+
+struct arena_chunk {
+    arena_chunk* next;
+    size_t size;                    // # usable bytes after this header
+    const char* file;               // the darena_alloc that added the chunk
+    long line;
+};
+static_assert(sizeof(arena_chunk) % ARENA_ALIGN == 0, "arena objects must stay aligned");
+
+struct dmalloc_arena {
+    const char* file;               // where the arena was created
+    long line;
+    const char* reset_file;         // the last darena_reset, if any
+    long reset_line;
+    arena_chunk* chunks;            // all chunks, current one first
+    arena_chunk* cur;
+    char* next;                     // bump pointer into `cur`
+    char* end;
+    size_t nactive;                 // # objects since the last reset
+    size_t active_size;             // # bytes requested since the last reset
+    dmalloc_arena* prev_arena;      // links in `arenas`
+    dmalloc_arena* next_arena;
+};
+
+static std::mutex arenas_lock;
+static dmalloc_arena* arenas;
+
+// Makes `chunk` the arena's current chunk.
+static void arena_use_chunk(dmalloc_arena* arena, arena_chunk* chunk) {
+    arena->cur = chunk;
+    arena->next = reinterpret_cast<char*>(chunk + 1);
+    arena->end = arena->next + chunk->size;
+}
+
+static void* init_block(dmalloc_cache* cache, alloc_header* h, char* block,
+                        size_t block_size, size_t sz, unsigned cls, unsigned align_shift,
+                        bool sampled, bool guarded, const char* file, long line,
+                        const void* frame);
+
+// Allocates `sz` bytes aligned to `1 << align_shift`; `align_shift` is 0 for
+// the default alignment.
+static void* allocate(size_t sz, unsigned align_shift, const char* file, long line,
+                      const void* frame) {
+    size_t pad = align_shift ? (size_t(1) << align_shift) - alignof(alloc_header) : 0;
+    if (pad > SIZE_MAX / 2
+        || sz > SIZE_MAX - sizeof(alloc_header) - TRAILER_SIZE - TCACHE_STEP - pad) {
+        record_failure(sz);
+        return nullptr;
+    }
+    dmalloc_cache* cache = get_thread_cache();
+    if (use_histograms()) {
+        hist_add(cache->size_hist, sz);
+    }
+    bool sampled = should_sample(cache, sz);
+    bool guarded = !pad && base_guards(sizeof(alloc_header) + sz);
+    size_t block_size = sizeof(alloc_header) + sz + (sampled && !guarded ? TRAILER_SIZE : 0) + pad;
+    unsigned cls = use_tcache() && !pad && !guarded ? size_class(block_size) : NO_SIZE_CLASS;
+
+    alloc_header* h = nullptr;
+    char* block;
+    if (cls != NO_SIZE_CLASS) {
+        block_size = class_size(cls);
+        if ((h = cache->bins[cls])) {
+            cache->bins[cls] = h->next;
+            --cache->bin_count[cls];
+        }
+    }
+    if (!h) {
+        h = reinterpret_cast<alloc_header*>(base_malloc(block_size));
+        if (!h) {
+            record_failure(sz);
+            return nullptr;
+        }
+        block = reinterpret_cast<char*>(h);
+        if (pad) {
+            uintptr_t payload = reinterpret_cast<uintptr_t>(h + 1) + pad;
+            payload &= ~((uintptr_t(1) << align_shift) - 1);
+            h = reinterpret_cast<alloc_header*>(payload) - 1;
+        }
+        update_heap_range(reinterpret_cast<uintptr_t>(h + 1),
+                          reinterpret_cast<uintptr_t>(block + block_size));
+    } else {
+        block = reinterpret_cast<char*>(h);
+    }
+    return init_block(cache, h, block, block_size, sz, cls, align_shift, sampled, guarded,
+                      file, line, frame);
+}
+
+// Sets up the header of the new block `h`, which sits in the base block
+// `block` of `block_size` bytes, and returns its payload. `sampled` blocks
+// are tracked in full; `guarded` ones end at a guard page and get no trailer. Callers widen the heap range to cover each fresh
+// base block, so a block reused from a bin, whatever its new size, already
+// lies within it.
+static void* init_block(dmalloc_cache* cache, alloc_header* h, char* block,
+                        size_t block_size, size_t sz, unsigned cls, unsigned align_shift,
+                        bool sampled, bool guarded, const char* file, long line,
+                        const void* frame) {
+    h->size = sz;
+    h->size_class = cls;
+    h->align_shift = align_shift;
+    h->guarded = guarded;
+    h->stack = 0;
+    char* payload = reinterpret_cast<char*>(h + 1);
+    if (use_shadow()) {
+        shadow_mark_block(reinterpret_cast<uintptr_t>(block), reinterpret_cast<uintptr_t>(payload),
+                          sz, reinterpret_cast<uintptr_t>(block + block_size));
+    }
+    if (!sampled) {
+        h->magic = ALLOC_FAST;
+        stat_add(cache->stats.nalloc, 1);
+        stat_add(cache->stats.alloc_size, sz);
+        if (trace_enabled()) {
+            trace_event(cache, DMTRACE_MALLOC, payload, sz, file, line);
+        }
+        return payload;
+    }
+
+    h->file = file;
+    h->line = line;
+    h->epoch = leak_epoch.load(std::memory_order_relaxed);
+    h->stack = capture_stack(frame);
+    h->owner = cache;
+    h->magic = ALLOC_ACTIVE;
+    memcpy(payload + sz, &TRAILER_CANARY, trailer_size(h));
+    unsigned long long weight = block_weight(h);
+
+    {
+        std::lock_guard<std::mutex> guard(cache->lock);
+        h->prev = nullptr;
+        h->next = cache->active;
+        if (h->next) {
+            h->next->prev = h;
+        }
+        cache->active = h;
+        hh_record(cache, file, line, weight);
+    }
+    stat_add(cache->stats.nalloc, 1);
+    stat_add(cache->stats.alloc_size, sz);
+    stat_add(cache->stats.nsampled, 1);
+    stat_add(cache->stats.sampled_alloc_size, weight);
+    site_record_alloc(h);
+    if (trace_enabled()) {
+        trace_event(cache, DMTRACE_MALLOC, payload, sz, file, line);
+    }
+    return payload;
+}
+
+// Times a public entry point into the calling thread's histogram `hist`
+// while histograms are on. Entry points that allocate (dmalloc, dcalloc,
+// drealloc and the aligned forms) count as malloc latency, dfree as free
+// latency. They call `allocate` and `release` rather than each other, so
+// nothing is timed twice.
+struct latency_timer {
+    histogram dmalloc_cache::* hist;
+    uint64_t start;
+
+    explicit latency_timer(histogram dmalloc_cache::* h)
+        : hist(h), start(use_histograms() ? read_cycles() : 0) {
+    }
+    ~latency_timer() {
+        if (use_histograms()) {
+            hist_add(get_thread_cache()->*hist, read_cycles() - start);
+        }
+    }
+};
 
 /**
  * dmalloc(sz,file,line)
@@ -15,11 +1207,45 @@
  * @return a pointer to the heap where the memory was reserved
  */
 void* dmalloc(size_t sz, const char* file, long line) {
-    (void) file, (void) line;   // avoid uninitialized variable warnings
-    // Your code here.
-    return base_malloc(sz);
+    latency_timer timer(&dmalloc_cache::malloc_cycles);
+    return allocate(sz, 0, file, line, __builtin_frame_address(0));
 }
 
+/**
+ * dmalloc_sized(sz, cls, tracked_cls, file, line)
+ *      dmalloc() with the per-thread cache classes for `sz` precomputed. The
+ *      block comes straight from the bin of its class, or from a fresh base
+ *      block of that class, with none of `allocate`'s size arithmetic.
+ */
+void* dmalloc_sized(size_t sz, unsigned cls, unsigned tracked_cls, const char* file, long line) {
+    latency_timer timer(&dmalloc_cache::malloc_cycles);
+    if (cls == NO_SIZE_CLASS || tracked_cls == NO_SIZE_CLASS || !use_tcache()
+        || base_guards(sizeof(alloc_header) + sz)) {
+        return allocate(sz, 0, file, line, __builtin_frame_address(0));
+    }
+    dmalloc_cache* cache = get_thread_cache();
+    if (use_histograms()) {
+        hist_add(cache->size_hist, sz);
+    }
+    bool sampled = should_sample(cache, sz);
+    unsigned c = sampled ? tracked_cls : cls;
+    alloc_header* h = cache->bins[c];
+    if (h) {
+        cache->bins[c] = h->next;
+        --cache->bin_count[c];
+    } else if ((h = reinterpret_cast<alloc_header*>(base_malloc(class_size(c))))) {
+        update_heap_range(reinterpret_cast<uintptr_t>(h + 1),
+                          reinterpret_cast<uintptr_t>(h) + class_size(c));
+    } else {
+        record_failure(sz);
+        return nullptr;
+    }
+    return init_block(cache, h, reinterpret_cast<char*>(h), class_size(c), sz, c, 0, sampled,
+                      false, file, line, __builtin_frame_address(0));
+}
+
+static void release(void* ptr, const char* file, long line);
+
 /**
  * dfree(ptr, file, line)
  *      free() wrapper. Release the block of heap memory pointed to by `ptr`. This should 
@@ -30,9 +1256,59 @@ void* dmalloc(size_t sz, const char* file, long line) {
  * @arg long line : the line number from which dfree was called 
  */
 void dfree(void* ptr, const char* file, long line) {
-    (void) file, (void) line;   // avoid uninitialized variable warnings
-    // Your code here.
-    base_free(ptr);
+    latency_timer timer(&dmalloc_cache::free_cycles);
+    release(ptr, file, line);
+}
+
+static void release(void* ptr, const char* file, long line) {
+    if (!ptr) {
+        return;
+    }
+    alloc_header* h = checked_header(ptr, file, line);
+    if (h->magic == ALLOC_FAST) {
+        dmalloc_cache* cache = get_thread_cache();
+        stat_add(cache->stats.nfree, 1);
+        stat_add(cache->stats.free_size, h->size);
+        h->magic = ALLOC_FREED;
+        if (trace_enabled()) {
+            trace_event(cache, DMTRACE_FREE, ptr, 0, nullptr, 0);
+        }
+        if (use_shadow()) {
+            shadow_poison(reinterpret_cast<uintptr_t>(ptr), h->size, SHADOW_FREED);
+        }
+        recycle_block(cache, h, false);
+        return;
+    }
+
+    dmalloc_cache* owner = h->owner;
+    {
+        std::unique_lock<std::mutex> guard(owner->lock);
+        check_tracked(guard, h, "free", file, line);
+        if (h->prev) {
+            h->prev->next = h->next;
+        } else {
+            owner->active = h->next;
+        }
+        if (h->next) {
+            h->next->prev = h->prev;
+        }
+        if (owner->scrub_next == h) {
+            owner->scrub_next = h->next;
+        }
+        h->magic = ALLOC_FREED;
+    }
+    site_record_free(h);
+    dmalloc_cache* cache = get_thread_cache();
+    stat_add(cache->stats.nfree, 1);
+    stat_add(cache->stats.free_size, h->size);
+    stat_add(cache->stats.sampled_free_size, block_weight(h));
+    if (trace_enabled()) {
+        trace_event(cache, DMTRACE_FREE, ptr, 0, nullptr, 0);
+    }
+    if (use_shadow()) {
+        shadow_poison(reinterpret_cast<uintptr_t>(ptr), h->size, SHADOW_FREED);
+    }
+    recycle_block(cache, h, true);
 }
 
 /**
@@ -49,14 +1325,401 @@ void dfree(void* ptr, const char* file, long line) {
  * @return a pointer to the heap where the memory was reserved
  */
 void* dcalloc(size_t nmemb, size_t sz, const char* file, long line) {
-    // Your code here (to fix test014).
-    void* ptr = dmalloc(nmemb * sz, file, line);
+    latency_timer timer(&dmalloc_cache::malloc_cycles);
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, sz, &total)) {
+        record_failure(SIZE_MAX);
+        return nullptr;
+    }
+    void* ptr = allocate(total, 0, file, line, __builtin_frame_address(0));
     if (ptr) {
-        memset(ptr, 0, nmemb * sz);
+        memset(ptr, 0, total);
     }
     return ptr;
 }
 
+/**
+ * drealloc(ptr, sz, file, line)
+ *      realloc() wrapper. Resize the block at `ptr` in place if the base block
+ *      has room, otherwise move it.
+ */
+void* drealloc(void* ptr, size_t sz, const char* file, long line) {
+    latency_timer timer(&dmalloc_cache::malloc_cycles);
+    if (!ptr) {
+        return allocate(sz, 0, file, line, __builtin_frame_address(0));
+    } else if (sz == 0) {
+        release(ptr, file, line);
+        return nullptr;
+    }
+    alloc_header* h = checked_header(ptr, file, line);
+    size_t old_size = h->size;
+    unsigned align_shift = h->align_shift;
+    // An in-place resize counts as a free of the old size and an allocation
+    // of the new one, so the totals match a moving realloc.
+    if (sz <= SIZE_MAX / 2 && !h->guarded) {
+        char* block = block_of(h);
+        size_t offset = reinterpret_cast<char*>(ptr) - block;
+        dmalloc_cache* cache = get_thread_cache();
+        if (h->magic == ALLOC_FAST) {
+            if (base_resize(block, offset + sz)) {
+                h->size = sz;
+                if (use_shadow()) {
+                    shadow_resize(reinterpret_cast<uintptr_t>(ptr), old_size, sz, 0);
+                }
+                stat_add(cache->stats.nfree, 1);
+                stat_add(cache->stats.free_size, old_size);
+                stat_add(cache->stats.nalloc, 1);
+                stat_add(cache->stats.alloc_size, sz);
+                update_heap_range(reinterpret_cast<uintptr_t>(ptr),
+                                  reinterpret_cast<uintptr_t>(ptr) + sz);
+                if (trace_enabled()) {
+                    trace_event(cache, DMTRACE_FREE, ptr, 0, nullptr, 0);
+                    trace_event(cache, DMTRACE_MALLOC, ptr, sz, file, line);
+                }
+                return ptr;
+            }
+        } else {
+            std::unique_lock<std::mutex> guard(h->owner->lock);
+            check_tracked(guard, h, "realloc", file, line);
+            if (base_resize(block, offset + sz + TRAILER_SIZE)) {
+                unsigned long long old_weight = block_weight(h);
+                site_record_free(h);
+                h->size = sz;
+                h->file = file;
+                h->line = line;
+                h->epoch = leak_epoch.load(std::memory_order_relaxed);
+                h->stack = capture_stack(__builtin_frame_address(0));
+                memcpy(reinterpret_cast<char*>(ptr) + sz, &TRAILER_CANARY, TRAILER_SIZE);
+                if (use_shadow()) {
+                    shadow_resize(reinterpret_cast<uintptr_t>(ptr), old_size, sz, TRAILER_SIZE);
+                }
+                unsigned long long weight = block_weight(h);
+                hh_record(h->owner, file, line, weight);
+                guard.unlock();
+                site_record_alloc(h);
+                stat_add(cache->stats.nfree, 1);
+                stat_add(cache->stats.free_size, old_size);
+                stat_add(cache->stats.sampled_free_size, old_weight);
+                stat_add(cache->stats.nalloc, 1);
+                stat_add(cache->stats.alloc_size, sz);
+                stat_add(cache->stats.nsampled, 1);
+                stat_add(cache->stats.sampled_alloc_size, weight);
+                update_heap_range(reinterpret_cast<uintptr_t>(ptr),
+                                  reinterpret_cast<uintptr_t>(ptr) + sz);
+                if (trace_enabled()) {
+                    trace_event(cache, DMTRACE_FREE, ptr, 0, nullptr, 0);
+                    trace_event(cache, DMTRACE_MALLOC, ptr, sz, file, line);
+                }
+                return ptr;
+            }
+        }
+    }
+
+    void* new_ptr = allocate(sz, align_shift, file, line, __builtin_frame_address(0));
+    if (new_ptr) {
+        memcpy(new_ptr, ptr, std::min(old_size, sz));
+        release(ptr, file, line);
+    }
+    return new_ptr;
+}
+
+static unsigned align_shift_of(size_t align) {
+    return align > alignof(alloc_header) ? __builtin_ctzll(align) : 0;
+}
+
+/**
+ * daligned_alloc(align, sz, file, line)
+ *      aligned_alloc() wrapper. Dynamically allocate `sz` bytes aligned to
+ *      `align`.
+ */
+void* daligned_alloc(size_t align, size_t sz, const char* file, long line) {
+    latency_timer timer(&dmalloc_cache::malloc_cycles);
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return allocate(sz, align_shift_of(align), file, line, __builtin_frame_address(0));
+}
+
+/**
+ * dposix_memalign(memptr, align, sz, file, line)
+ *      posix_memalign() wrapper.
+ */
+int dposix_memalign(void** memptr, size_t align, size_t sz, const char* file, long line) {
+    latency_timer timer(&dmalloc_cache::malloc_cycles);
+    if (align < sizeof(void*) || (align & (align - 1)) != 0) {
+        return EINVAL;
+    }
+    void* ptr = allocate(sz, align_shift_of(align), file, line, __builtin_frame_address(0));
+    if (!ptr) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+// Returns the header of the dmalloc block in base block `block`, or nullptr
+// if it holds none (a block dmalloc uses for its own bookkeeping).
+// Over-aligned blocks put the header just before the first payload address
+// on the alignment boundary, so try each alignment the block could hold.
+static alloc_header* header_in_block(char* block, size_t block_size) {
+    if (block_size < sizeof(alloc_header)) {
+        return nullptr;
+    }
+    auto valid = [](alloc_header* h) {
+        return h->magic == ALLOC_ACTIVE || h->magic == ALLOC_FAST || h->magic == ALLOC_FREED;
+    };
+    alloc_header* h = reinterpret_cast<alloc_header*>(block);
+    if (valid(h) && h->align_shift == 0) {
+        return h;
+    }
+    uintptr_t start = reinterpret_cast<uintptr_t>(block) + sizeof(alloc_header);
+    for (unsigned shift = __builtin_ctzll(alignof(alloc_header)) + 1;
+         (size_t(1) << shift) < block_size; ++shift) {
+        uintptr_t payload = (start + (uintptr_t(1) << shift) - 1) & -(uintptr_t(1) << shift);
+        if (payload > reinterpret_cast<uintptr_t>(block) + block_size) {
+            break;
+        }
+        h = reinterpret_cast<alloc_header*>(payload) - 1;
+        if (valid(h) && h->align_shift == shift) {
+            return h;
+        }
+    }
+    return nullptr;
+}
+
+static const char* shadow_kind(uint8_t v) {
+    switch (v) {
+    case SHADOW_HEADER:
+        return "heap buffer underflow";
+    case SHADOW_FREED:
+        return "use after free";
+    default:
+        return "heap buffer overflow";
+    }
+}
+
+/**
+ * dmalloc_check_range(ptr, len)
+ *      Check an access of `len` bytes at `ptr` against the shadow map.
+ */
+bool dmalloc_check_range(const void* ptr, size_t len) {
+    if (!use_shadow() || len == 0) {
+        return true;
+    }
+    uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    uintptr_t end = addr + len;
+    uintptr_t g = addr >> SHADOW_SCALE, last = (end - 1) >> SHADOW_SCALE;
+    uint8_t v = 0;
+    while (g <= last) {
+        // skip eight fully addressable granules (64 bytes) per load
+        uint64_t word;
+        if (last - g >= 8 && (memcpy(&word, shadow_base + g, 8), word == 0)) {
+            g += 8;
+            continue;
+        }
+        v = shadow_base[g];
+        uintptr_t granule_end = std::min(end, (g + 1) << SHADOW_SCALE) - (g << SHADOW_SCALE);
+        if (v != 0 && (v >= SHADOW_GRANULE || granule_end > v)) {
+            break;
+        }
+        ++g;
+    }
+    if (g > last) {
+        return true;
+    }
+    uintptr_t bad = std::max(addr, (g << SHADOW_SCALE) + (v < SHADOW_GRANULE ? v : 0));
+    fprintf(stderr, "MEMORY BUG: invalid access of %zu bytes at %p, %s at %p\n",
+            len, ptr, shadow_kind(v), reinterpret_cast<void*>(bad));
+    // name the nearest block: the one containing `bad` or, for an overflow,
+    // the one it ran off the end of
+    size_t block_size;
+    void* block = base_find_allocation(reinterpret_cast<void*>(bad), &block_size);
+    if (!block) {
+        block = base_find_freed(reinterpret_cast<void*>(bad), &block_size);
+    }
+    if (block) {
+        alloc_header* h = header_in_block(reinterpret_cast<char*>(block), block_size);
+        if (h && h->magic == ALLOC_ACTIVE) {
+            uintptr_t payload = reinterpret_cast<uintptr_t>(h + 1);
+            fprintf(stderr, "%s: %p is %zd bytes from the start of a %zu byte region allocated here\n",
+                    site_name(h->file, h->line).text, reinterpret_cast<void*>(bad),
+                    ssize_t(bad - payload), h->size);
+            print_stack(stderr, h->stack);
+        }
+    }
+    return false;
+}
+
+struct heap_check_state {
+    size_t nblocks;
+    size_t nerrors;
+};
+
+static void heap_check_block(void* ptr, size_t block_size, void* arg) {
+    auto* state = reinterpret_cast<heap_check_state*>(arg);
+    char* block = reinterpret_cast<char*>(ptr);
+    alloc_header* h = header_in_block(block, block_size);
+    if (!h) {
+        // Without the shadow map a smashed header is indistinguishable from
+        // memory dmalloc uses internally; with it, dmalloc blocks start with
+        // header shadow.
+        if (use_shadow() && *shadow_of(reinterpret_cast<uintptr_t>(block)) == SHADOW_HEADER) {
+            fprintf(stderr, "MEMORY BUG: heap check: corrupt header in block %p\n", ptr);
+            ++state->nerrors;
+        }
+        return;
+    }
+    ++state->nblocks;
+    char* payload = reinterpret_cast<char*>(h + 1);
+    size_t capacity = block + block_size - payload;
+    if (h->magic == ALLOC_FREED) {
+        return;
+    } else if (h->size > capacity
+               || (h->magic == ALLOC_ACTIVE && capacity - h->size < trailer_size(h))) {
+        fprintf(stderr, "MEMORY BUG: heap check: corrupt header for pointer %p\n", payload);
+        ++state->nerrors;
+    } else if (h->magic == ALLOC_ACTIVE
+               && memcmp(payload + h->size, &TRAILER_CANARY, trailer_size(h)) != 0) {
+        fprintf(stderr, "MEMORY BUG: %s: detected wild write after pointer %p\n",
+                site_name(h->file, h->line).text, payload);
+        print_stack(stderr, h->stack);
+        ++state->nerrors;
+    }
+}
+
+/**
+ * dmalloc_check_heap()
+ *      Check the header and canary of every block in one pass over the heap.
+ */
+size_t dmalloc_check_heap() {
+    heap_check_state state = {0, 0};
+    base_for_each_block(heap_check_block, &state);
+    return state.nerrors;
+}
+
+// Background scrubber (DMALLOC_SCRUB=ms, or dmalloc_start_scrubber). A
+// detached SCHED_IDLE thread wakes every interval and checks the next
+// `blocks_per_tick` tracked blocks, resuming each time where it stopped, so
+// corruption is found soon after it happens rather than when the block is
+// freed. It walks the threads' active lists under each list's own lock, at
+// most SCRUB_BATCH blocks per acquisition, so an allocating thread waits for
+// at most one short batch. Each cache's `scrub_next` marks the scrubber's
+// position; `dfree` advances it past a block it unlinks, so the scrubber never
+// touches freed memory. ALLOC_FAST blocks are on no list and have no canary,
+// so only tracked blocks are scrubbed. `dmalloc_scrub` runs the same step on
+// the calling thread, sharing the scrubber's position.
+static constexpr size_t SCRUB_BATCH = 32;
+static constexpr size_t SCRUB_DEFAULT_BLOCKS = 256;
+
+static std::atomic<unsigned> scrub_interval_ms{0};      // 0 until started
+static std::atomic<size_t> scrub_blocks{SCRUB_DEFAULT_BLOCKS};
+
+// protected by `scrub_lock`, which is taken before any cache's lock
+static std::mutex scrub_lock;
+static dmalloc_cache* scrub_cache;  // cache being scrubbed, or nullptr
+static bool scrub_resume;           // continue from `scrub_cache->scrub_next`
+
+// Checks the tracked block `h` on `c`'s active list. Requires `c->lock`.
+static void scrub_block(dmalloc_cache* c, alloc_header* h) {
+    void* ptr = h + 1;
+    size_t block_size;
+    char* block = reinterpret_cast<char*>(base_find_allocation(h, &block_size));
+    if (h->magic != ALLOC_ACTIVE || h->owner != c || !block
+        || (h->next && h->next->prev != h)
+        || h->size > size_t(block + block_size - reinterpret_cast<char*>(ptr))
+        || block + block_size - reinterpret_cast<char*>(ptr) - h->size < trailer_size(h)) {
+        fprintf(stderr, "MEMORY BUG: scrubber found corrupt header for pointer %p\n", ptr);
+        abort();
+    }
+    if (memcmp(reinterpret_cast<char*>(ptr) + h->size, &TRAILER_CANARY, trailer_size(h)) != 0) {
+        fprintf(stderr, "MEMORY BUG: %s: scrubber detected wild write after pointer %p\n",
+                site_name(h->file, h->line).text, ptr);
+        print_stack(stderr, h->stack);
+        abort();
+    }
+}
+
+// Checks up to `budget` blocks, visiting each cache at most once. Returns
+// the number of blocks checked.
+static size_t scrub_tick(size_t budget) {
+    std::lock_guard<std::mutex> scrub_guard(scrub_lock);
+    size_t nchecked = 0;
+    for (dmalloc_cache* first = nullptr; budget; ) {
+        if (!scrub_cache) {
+            scrub_cache = all_caches.load(std::memory_order_acquire);
+            scrub_resume = false;
+        }
+        if (scrub_cache == first || !scrub_cache) {
+            break;
+        }
+        first = first ? first : scrub_cache;
+        dmalloc_cache* c = scrub_cache;
+        bool done = false;
+        while (budget && !done) {
+            std::lock_guard<std::mutex> guard(c->lock);
+            alloc_header* h = scrub_resume ? c->scrub_next : c->active;
+            scrub_resume = true;
+            for (size_t n = 0; h && n != SCRUB_BATCH && budget; ++n, --budget) {
+                scrub_block(c, h);
+                ++nchecked;
+                h = h->next;
+            }
+            c->scrub_next = h;
+            done = !h;
+        }
+        if (done) {
+            scrub_cache = c->next_cache;
+            scrub_resume = false;
+        }
+    }
+    return nchecked;
+}
+
+static void* scrubber_main(void*) {
+    sched_param param = {};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    while (true) {
+        unsigned ms = scrub_interval_ms.load(std::memory_order_relaxed);
+        timespec ts = {time_t(ms / 1000), long(ms % 1000) * 1000000};
+        nanosleep(&ts, nullptr);
+        scrub_tick(scrub_blocks.load(std::memory_order_relaxed));
+    }
+    return nullptr;
+}
+
+void dmalloc_start_scrubber(unsigned interval_ms, size_t blocks_per_tick) {
+    scrub_blocks = blocks_per_tick ? blocks_per_tick : SCRUB_DEFAULT_BLOCKS;
+    if (scrub_interval_ms.exchange(interval_ms ? interval_ms : 1) == 0) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, scrubber_main, nullptr) != 0) {
+            scrub_interval_ms = 0;
+        }
+        pthread_attr_destroy(&attr);
+    }
+}
+
+size_t dmalloc_scrub(size_t nblocks) {
+    return scrub_tick(nblocks ? nblocks : SCRUB_DEFAULT_BLOCKS);
+}
+
+static void scrubber_autostart() {
+    static const bool started = [] {
+        const char* env = getenv("DMALLOC_SCRUB");
+        if (!env || !env[0]) {
+            return false;
+        }
+        const char* blocks = getenv("DMALLOC_SCRUB_BLOCKS");
+        dmalloc_start_scrubber(strtoul(env, nullptr, 0),
+                               blocks ? strtoull(blocks, nullptr, 0) : 0);
+        return true;
+    }();
+    (void) started;
+}
+
 /**
  * get_statistics(stats)
  *      fill a dmalloc_stats pointer with the current memory statistics  
@@ -64,9 +1727,33 @@ void* dcalloc(size_t nmemb, size_t sz, const char* file, long line) {
  * @arg dmalloc_stats *stats : a pointer to the the dmalloc_stats struct we want to fill
  */
 void get_statistics(dmalloc_stats* stats) {
-    // Stub: set all statistics to enormous numbers
-    memset(stats, 255, sizeof(dmalloc_stats));
-    // Your code here.
+    // Sum the shards without locking. Frees are loaded before allocations so
+    // a concurrent alloc/free pair cannot make the active counts wrap.
+    memset(stats, 0, sizeof(dmalloc_stats));
+    unsigned long long nfree = 0, free_size = 0, sampled_free_size = 0;
+    for (dmalloc_cache* c = all_caches.load(); c; c = c->next_cache) {
+        nfree += c->stats.nfree.load(std::memory_order_relaxed);
+        free_size += c->stats.free_size.load(std::memory_order_relaxed);
+        sampled_free_size += c->stats.sampled_free_size.load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    for (dmalloc_cache* c = all_caches.load(); c; c = c->next_cache) {
+        stats->ntotal += c->stats.nalloc.load(std::memory_order_relaxed);
+        stats->total_size += c->stats.alloc_size.load(std::memory_order_relaxed);
+        stats->nfail += c->stats.nfail.load(std::memory_order_relaxed);
+        stats->fail_size += c->stats.fail_size.load(std::memory_order_relaxed);
+        stats->nsampled += c->stats.nsampled.load(std::memory_order_relaxed);
+        stats->sampled_total_size += c->stats.sampled_alloc_size.load(std::memory_order_relaxed);
+    }
+    stats->nactive = stats->ntotal - std::min(nfree, stats->ntotal);
+    stats->active_size = stats->total_size - std::min(free_size, stats->total_size);
+    stats->sampled_active_size = stats->sampled_total_size
+        - std::min(sampled_free_size, stats->sampled_total_size);
+    if (heap_max.load() != 0) {
+        stats->heap_min = heap_min.load();
+        stats->heap_max = heap_max.load();
+    }
+    base_get_statistics(stats);
 }
 
 /**
@@ -81,13 +1768,653 @@ void print_statistics() {
            stats.nactive, stats.ntotal, stats.nfail);
     printf("alloc size:  active %10llu   total %10llu   fail %10llu\n",
            stats.active_size, stats.total_size, stats.fail_size);
+    if (sample_rate() != 0) {
+        printf("sampled:     count  %9llu   est. active %10llu   est. total %10llu\n",
+               stats.nsampled, stats.sampled_active_size, stats.sampled_total_size);
+    }
+}
+
+// Sums histogram `which` over every thread's cache into `out`, returning
+// the total count.
+static unsigned long long hist_merge(histogram dmalloc_cache::* which,
+                                     unsigned long long* out) {
+    unsigned long long total = 0;
+    memset(out, 0, HIST_NBUCKETS * sizeof(*out));
+    for (dmalloc_cache* c = all_caches.load(); c; c = c->next_cache) {
+        histogram& hist = c->*which;
+        for (unsigned b = 0; b != HIST_NBUCKETS; ++b) {
+            unsigned long long n = hist.bucket[b].load(std::memory_order_relaxed);
+            out[b] += n;
+            total += n;
+        }
+    }
+    return total;
+}
+
+// Returns the upper bound (exclusive) of the bucket holding quantile `q`.
+static uint64_t hist_quantile(const unsigned long long* buckets,
+                              unsigned long long total, double q) {
+    unsigned long long rank = std::max<unsigned long long>(llround(q * total), 1);
+    unsigned long long seen = 0;
+    for (unsigned b = 0; b != HIST_NBUCKETS; ++b) {
+        seen += buckets[b];
+        if (seen >= rank) {
+            return b + 1 < HIST_NBUCKETS ? hist_bucket_min(b + 1) : UINT64_MAX;
+        }
+    }
+    return 0;
+}
+
+static const struct {
+    const char* name;
+    const char* unit;
+    histogram dmalloc_cache::* which;
+} histograms[] = {
+    {"size", "bytes", &dmalloc_cache::size_hist},
+#if defined(__x86_64__) || defined(__i386__)
+    {"malloc_latency", "cycles", &dmalloc_cache::malloc_cycles},
+    {"free_latency", "cycles", &dmalloc_cache::free_cycles},
+#else
+    {"malloc_latency", "ns", &dmalloc_cache::malloc_cycles},
+    {"free_latency", "ns", &dmalloc_cache::free_cycles},
+#endif
+};
+
+/**
+ * print_histograms()
+ *      Print the size and latency histograms to stdout.
+ */
+void print_histograms() {
+    if (!use_histograms()) {
+        printf("HISTOGRAM: disabled, set DMALLOC_HISTOGRAMS=1\n");
+        return;
+    }
+    unsigned long long buckets[HIST_NBUCKETS];
+    for (auto& hd : histograms) {
+        unsigned long long total = hist_merge(hd.which, buckets);
+        printf("HISTOGRAM %s (%s): %llu samples", hd.name, hd.unit, total);
+        if (total) {
+            printf(", p50 < %" PRIu64 ", p90 < %" PRIu64 ", p99 < %" PRIu64,
+                   hist_quantile(buckets, total, 0.5), hist_quantile(buckets, total, 0.9),
+                   hist_quantile(buckets, total, 0.99));
+        }
+        printf("\n");
+        unsigned long long seen = 0;
+        for (unsigned b = 0; b != HIST_NBUCKETS; ++b) {
+            if (!buckets[b]) {
+                continue;
+            }
+            seen += buckets[b];
+            uint64_t hi = b + 1 < HIST_NBUCKETS ? hist_bucket_min(b + 1) : UINT64_MAX;
+            printf("  %10" PRIu64 " .. %-10" PRIu64 " %10llu %6.2f%% %6.2f%%\n",
+                   hist_bucket_min(b), hi - 1, buckets[b], 100.0 * buckets[b] / total,
+                   100.0 * seen / total);
+        }
+    }
+}
+
+/**
+ * print_histograms_json(f)
+ *      Write the histograms to `f` as one JSON object.
+ */
+void print_histograms_json(FILE* f) {
+    unsigned long long buckets[HIST_NBUCKETS];
+    fprintf(f, "{\"enabled\": %s", use_histograms() ? "true" : "false");
+    for (auto& hd : histograms) {
+        unsigned long long total = hist_merge(hd.which, buckets);
+        fprintf(f, ", \"%s\": {\"unit\": \"%s\", \"count\": %llu, \"buckets\": [",
+                hd.name, hd.unit, total);
+        const char* sep = "";
+        for (unsigned b = 0; b != HIST_NBUCKETS; ++b) {
+            if (buckets[b]) {
+                uint64_t hi = b + 1 < HIST_NBUCKETS ? hist_bucket_min(b + 1) - 1 : UINT64_MAX;
+                fprintf(f, "%s{\"min\": %" PRIu64 ", \"max\": %" PRIu64 ", \"count\": %llu}",
+                        sep, hist_bucket_min(b), hi, buckets[b]);
+                sep = ", ";
+            }
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "}\n");
 }
 
 /**  
- * print_leak_report()
+ * print_leak_report(since)
  *      Print a report of all currently-active allocated blocks of dynamic
- *      memory.
+ *      memory, or only those allocated since checkpoint `since`. Arenas are
+ *      not tracked by checkpoint and appear only in the full report.
+ */
+void print_leak_report(unsigned since) {
+    if (sample_rate() != 0) {
+        printf("LEAK CHECK: sampling 1 in %zu bytes, unsampled blocks are not listed\n",
+               sample_rate());
+    }
+    for (dmalloc_cache* c = all_caches.load(); c; c = c->next_cache) {
+        std::lock_guard<std::mutex> guard(c->lock);
+        for (alloc_header* h = c->active; h; h = h->next) {
+            if (h->epoch < since) {
+                continue;
+            }
+            printf("LEAK CHECK: %s: allocated object %p with size %zu\n",
+                   site_name(h->file, h->line).text, static_cast<void*>(h + 1), h->size);
+            print_stack(stdout, h->stack);
+        }
+    }
+    if (since != 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(arenas_lock);
+    for (dmalloc_arena* a = arenas; a; a = a->next_arena) {
+        char reset[600] = "";
+        if (a->reset_file) {
+            snprintf(reset, sizeof(reset), ", last reset at %s",
+                     site_name(a->reset_file, a->reset_line).text);
+        }
+        if (a->nactive) {
+            printf("LEAK CHECK: %s: allocated arena %p with size %zu in %zu objects%s\n",
+                   site_name(a->file, a->line).text, static_cast<void*>(a), a->active_size,
+                   a->nactive, reset);
+        } else {
+            printf("LEAK CHECK: %s: undestroyed arena %p%s\n",
+                   site_name(a->file, a->line).text, static_cast<void*>(a), reset);
+        }
+        for (arena_chunk* chunk = a->chunks; chunk; chunk = chunk->next) {
+            printf("LEAK CHECK: %s: arena %p chunk %p with size %zu\n",
+                   site_name(chunk->file, chunk->line).text, static_cast<void*>(a),
+                   static_cast<void*>(chunk), chunk->size);
+        }
+    }
+}
+
+/**
+ * print_leak_summary(since)
+ *      Print active blocks grouped by allocation site, largest total first.
+ */
+void print_leak_summary(unsigned since) {
+    // One bucket per site-table slot plus one for sites that did not fit,
+    // so memory is fixed however many blocks are live.
+    struct leak_bucket {
+        const char* file;
+        long line;
+        unsigned long long count;
+        unsigned long long bytes;
+    };
+    static constexpr size_t NBUCKETS = SITE_TABLE_SIZE + 1;
+    leak_bucket* buckets = reinterpret_cast<leak_bucket*>(
+        internal_alloc(NBUCKETS * sizeof(leak_bucket)));
+    if (!buckets) {
+        return;
+    }
+    memset(buckets, 0, NBUCKETS * sizeof(leak_bucket));
+
+    for (dmalloc_cache* c = all_caches.load(); c; c = c->next_cache) {
+        std::lock_guard<std::mutex> guard(c->lock);
+        const char* last_file = nullptr;
+        long last_line = 0;
+        size_t b = SITE_TABLE_SIZE;
+        for (alloc_header* h = c->active; h; h = h->next) {
+            if (h->epoch < since) {
+                continue;
+            }
+            // blocks from one site tend to sit together on the list
+            if (h->file != last_file || h->line != last_line) {
+                alloc_site* site = site_lookup(h->file, h->line, false);
+                b = site && site != &overflow_site ? site - site_table : SITE_TABLE_SIZE;
+                last_file = h->file;
+                last_line = h->line;
+            }
+            if (b != SITE_TABLE_SIZE) {
+                buckets[b].file = h->file;
+                buckets[b].line = h->line;
+            }
+            ++buckets[b].count;
+            buckets[b].bytes += block_weight(h);
+        }
+    }
+
+    // Compact the used buckets and sort them by bytes.
+    size_t n = 0;
+    for (size_t b = 0; b != NBUCKETS; ++b) {
+        if (buckets[b].count) {
+            buckets[n++] = buckets[b];
+        }
+    }
+    std::sort(buckets, buckets + n, [] (const leak_bucket& a, const leak_bucket& b) {
+        return a.bytes > b.bytes;
+    });
+
+    if (sample_rate() != 0) {
+        printf("LEAK SUMMARY: sampling 1 in %zu bytes, sizes are estimates\n",
+               sample_rate());
+    }
+    for (size_t i = 0; i != n; ++i) {
+        if (buckets[i].file) {
+            printf("LEAK SUMMARY: %s: %llu bytes in %llu objects\n",
+                   site_name(buckets[i].file, buckets[i].line).text, buckets[i].bytes, buckets[i].count);
+        } else {
+            printf("LEAK SUMMARY: other sites: %llu bytes in %llu objects\n",
+                   buckets[i].bytes, buckets[i].count);
+        }
+    }
+    base_free(buckets);
+
+    if (since == 0) {
+        std::lock_guard<std::mutex> guard(arenas_lock);
+        for (dmalloc_arena* a = arenas; a; a = a->next_arena) {
+            if (!a->nactive) {
+                continue;
+            }
+            printf("LEAK SUMMARY: %s: arena %p with %zu bytes in %zu objects\n",
+                   site_name(a->file, a->line).text, static_cast<void*>(a), a->active_size, a->nactive);
+        }
+    }
+}
+
+/**
+ * dmalloc_leak_checkpoint()
+ *      Start a new leak-check period and return its checkpoint.
+ */
+unsigned dmalloc_leak_checkpoint() {
+    return ++leak_epoch;
+}
+
+// A snapshot copies the site table's live counters: one entry per site
+// with live blocks, in site-table order, so taking one costs a pass over the
+// table rather than the heap, and two snapshots diff with a merge. Site
+// table slots are never reused, so an entry can keep just its slot index
+// (SITE_TABLE_SIZE for `overflow_site`).
+struct snapshot_entry {
+    uint32_t site;
+    unsigned long long count;
+    unsigned long long bytes;
+};
+
+struct heap_snapshot {
+    heap_snapshot* next;
+    char name[64];
+    size_t n;
+    snapshot_entry* entries;        // follows the struct
+};
+
+static std::mutex snapshots_lock;
+static heap_snapshot* snapshots;
+
+static const alloc_site& snapshot_site(uint32_t i) {
+    return i == SITE_TABLE_SIZE ? overflow_site : site_table[i];
+}
+
+// Allocates a snapshot of the current site counters. Sites gaining their
+// first live block while this runs may be missed.
+static heap_snapshot* take_snapshot(const char* name) {
+    size_t cap = 0;
+    for (uint32_t i = 0; i <= SITE_TABLE_SIZE; ++i) {
+        cap += snapshot_site(i).nactive.load(std::memory_order_relaxed) != 0;
+    }
+    cap += cap / 8 + 16;
+    heap_snapshot* snap = reinterpret_cast<heap_snapshot*>(
+        internal_alloc(sizeof(heap_snapshot) + cap * sizeof(snapshot_entry)));
+    if (!snap) {
+        return nullptr;
+    }
+    snap->next = nullptr;
+    snprintf(snap->name, sizeof(snap->name), "%s", name);
+    snap->entries = reinterpret_cast<snapshot_entry*>(snap + 1);
+    snap->n = 0;
+    for (uint32_t i = 0; i <= SITE_TABLE_SIZE && snap->n != cap; ++i) {
+        const alloc_site& site = snapshot_site(i);
+        if (unsigned long long count = site.nactive.load(std::memory_order_relaxed)) {
+            snap->entries[snap->n++] = {i, count,
+                                        site.active_bytes.load(std::memory_order_relaxed)};
+        }
+    }
+    return snap;
+}
+
+// Returns the snapshot named `name`, or nullptr. Requires `snapshots_lock`.
+static heap_snapshot* find_snapshot(const char* name) {
+    heap_snapshot* snap = snapshots;
+    while (snap && strcmp(snap->name, name) != 0) {
+        snap = snap->next;
+    }
+    return snap;
+}
+
+/**
+ * dmalloc_snapshot(name)
+ *      Record the live heap per allocation site under `name`.
+ */
+void dmalloc_snapshot(const char* name) {
+    heap_snapshot* snap = take_snapshot(name);
+    if (!snap) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(snapshots_lock);
+    for (heap_snapshot** pp = &snapshots; *pp; pp = &(*pp)->next) {
+        if (strcmp((*pp)->name, snap->name) == 0) {
+            heap_snapshot* old = *pp;
+            *pp = old->next;
+            base_free(old);
+            break;
+        }
+    }
+    snap->next = snapshots;
+    snapshots = snap;
+}
+
+/**
+ * print_snapshot_diff(from, to)
+ *      Print per-site heap growth between two snapshots.
+ */
+void print_snapshot_diff(const char* from, const char* to) {
+    heap_snapshot* current = to ? nullptr : take_snapshot("(now)");
+    if (!to && !current) {
+        printf("SNAPSHOT DIFF: out of memory for the current snapshot\n");
+        return;
+    }
+    std::lock_guard<std::mutex> guard(snapshots_lock);
+    heap_snapshot* a = find_snapshot(from);
+    heap_snapshot* b = to ? find_snapshot(to) : current;
+    if (!a || !b) {
+        printf("SNAPSHOT DIFF: no snapshot named %s\n", !a ? from : to);
+        base_free(current);
+        return;
+    }
+
+    // Merge the two entry lists, keeping changed sites. The result fits in
+    // `a->n + b->n` entries.
+    struct site_delta {
+        uint32_t site;
+        long long count;
+        long long bytes;
+        unsigned long long now_count;
+        unsigned long long now_bytes;
+    };
+    site_delta* deltas = reinterpret_cast<site_delta*>(
+        internal_alloc((a->n + b->n + 1) * sizeof(site_delta)));
+    if (!deltas) {
+        base_free(current);
+        return;
+    }
+    size_t n = 0, i = 0, j = 0;
+    long long total_count = 0, total_bytes = 0;
+    while (i != a->n || j != b->n) {
+        snapshot_entry zero = {0, 0, 0};
+        const snapshot_entry* x = &zero;
+        const snapshot_entry* y = &zero;
+        if (j == b->n || (i != a->n && a->entries[i].site < b->entries[j].site)) {
+            x = &a->entries[i];
+            zero.site = x->site;
+            ++i;
+        } else if (i == a->n || b->entries[j].site < a->entries[i].site) {
+            y = &b->entries[j];
+            zero.site = y->site;
+            ++j;
+        } else {
+            x = &a->entries[i++];
+            y = &b->entries[j++];
+        }
+        site_delta d = {x->site, (long long) (y->count - x->count),
+                        (long long) (y->bytes - x->bytes), y->count, y->bytes};
+        total_count += d.count;
+        total_bytes += d.bytes;
+        if (d.count != 0 || d.bytes != 0) {
+            deltas[n++] = d;
+        }
+    }
+    // ties go to the site with more new objects, so the order does not
+    // depend on where sites landed in the table
+    std::sort(deltas, deltas + n, [] (const site_delta& x, const site_delta& y) {
+        if (x.bytes != y.bytes) {
+            return x.bytes > y.bytes;
+        }
+        return x.count != y.count ? x.count > y.count : x.site < y.site;
+    });
+
+    printf("SNAPSHOT DIFF %s -> %s: %+lld bytes in %+lld objects\n",
+           a->name, b->name, total_bytes, total_count);
+    for (size_t k = 0; k != n; ++k) {
+        const alloc_site& site = snapshot_site(deltas[k].site);
+        const char* file = reinterpret_cast<const char*>(site.file.load());
+        printf("SNAPSHOT DIFF: %s: %+lld bytes in %+lld objects, now %llu bytes in %llu objects\n",
+               &site == &overflow_site ? "other sites" : site_name(file, site.line).text,
+               deltas[k].bytes, deltas[k].count, deltas[k].now_bytes, deltas[k].now_count);
+    }
+    base_free(deltas);
+    base_free(current);
+}
+
+/**
+ * dmalloc_set_stack_depth(depth)
+ *      Set how many callers to record for tracked allocations.
+ */
+void dmalloc_set_stack_depth(unsigned depth) {
+    stack_depth_setting.store(std::min(depth, STACK_MAX_DEPTH));
+}
+
+/**
+ * print_heavy_hitter_report()
+ *      Print the allocation sites responsible for the most allocated bytes,
+ *      largest first.
+ */
+void print_heavy_hitter_report() {
+    // Merge the per-thread summaries by adding counts (and errors) for equal
+    // sites. A site missing from a full summary may still have had up to that
+    // summary's smallest count there, so it gets that much added to its count
+    // and its error, which keeps every count an overestimate with a true
+    // error bound. `missing` is the sum of the smallest counts of all full
+    // summaries and `present` the part of it from summaries the site is in.
+    // New caches are pushed on the front of `all_caches`, so the list from
+    // `first` on does not change under us.
+    struct hh_merged {
+        hh_counter x;
+        unsigned long long present;
+    };
+    dmalloc_cache* first = all_caches.load();
+    size_t ncaches = 0;
+    for (dmalloc_cache* c = first; c; c = c->next_cache) {
+        ++ncaches;
+    }
+    hh_merged* merged = reinterpret_cast<hh_merged*>(
+        internal_alloc(std::max(ncaches, size_t(1)) * HH_COUNTERS * sizeof(hh_merged)));
+    if (!merged) {
+        fprintf(stderr, "dmalloc: out of memory for heavy hitter report\n");
+        return;
+    }
+    size_t nmerged = 0;
+    unsigned long long missing = 0;
+    for (dmalloc_cache* c = first; c; c = c->next_cache) {
+        std::lock_guard<std::mutex> guard(c->lock);
+        unsigned long long min = 0;
+        if (c->hh_used == HH_COUNTERS) {
+            min = c->hh[0].bytes;
+            for (unsigned i = 1; i != HH_COUNTERS; ++i) {
+                min = std::min(min, c->hh[i].bytes);
+            }
+        }
+        missing += min;
+        for (unsigned i = 0; i != c->hh_used; ++i) {
+            const hh_counter& x = c->hh[i];
+            size_t j = 0;
+            while (j != nmerged && (merged[j].x.file != x.file || merged[j].x.line != x.line)) {
+                ++j;
+            }
+            if (j == nmerged) {
+                merged[nmerged++] = {x, min};
+            } else {
+                merged[j].x.bytes += x.bytes;
+                merged[j].x.error += x.error;
+                merged[j].present += min;
+            }
+        }
+    }
+    for (size_t j = 0; j != nmerged; ++j) {
+        merged[j].x.bytes += missing - merged[j].present;
+        merged[j].x.error += missing - merged[j].present;
+    }
+    std::sort(merged, merged + nmerged, [] (const hh_merged& a, const hh_merged& b) {
+        return a.x.bytes > b.x.bytes;
+    });
+    nmerged = std::min(nmerged, size_t(HH_COUNTERS));
+
+    for (size_t i = 0; i != nmerged; ++i) {
+        const hh_counter& x = merged[i].x;
+        // prefer the exact count from the site table when we have one
+        alloc_site* site = site_lookup(x.file, x.line, false);
+        if (site && site != &overflow_site) {
+            printf("HEAVY HITTER: %s: %llu bytes in %llu allocations, %llu bytes active\n",
+                   site_name(x.file, x.line).text, site->alloc_bytes.load(), site->nalloc.load(),
+                   site->active_bytes.load());
+        } else {
+            printf("HEAVY HITTER: %s: %llu bytes (+/- %llu)\n",
+                   site_name(x.file, x.line).text, x.bytes, x.error);
+        }
+    }
+    base_free(merged);
+}
+
+/**
+ * darena_create(file, line)
+ *      Create an empty arena.
+ *
+ * @arg const char *file : a string containing the filename from which darena_create was called
+ * @arg long line : the line number from which darena_create was called
+ *
+ * @return the new arena, or nullptr if out of memory
+ */
+dmalloc_arena* darena_create(const char* file, long line) {
+    dmalloc_arena* arena = reinterpret_cast<dmalloc_arena*>(internal_alloc(sizeof(dmalloc_arena)));
+    if (!arena) {
+        return nullptr;
+    }
+    memset(arena, 0, sizeof(dmalloc_arena));
+    arena->file = file;
+    arena->line = line;
+    std::lock_guard<std::mutex> guard(arenas_lock);
+    arena->next_arena = arenas;
+    if (arenas) {
+        arenas->prev_arena = arena;
+    }
+    arenas = arena;
+    return arena;
+}
+
+/**
+ * darena_alloc(arena, sz, file, line)
+ *      Allocate `sz` bytes from `arena`. The memory stays valid until the
+ *      arena is reset or destroyed.
+ *
+ * @arg dmalloc_arena *arena : the arena to allocate from
+ * @arg size_t sz : the amount of memory requested
+ * @arg const char *file : a string containing the filename from which darena_alloc was called
+ * @arg long line : the line number from which darena_alloc was called
+ *
+ * @return a pointer to the memory, or nullptr if out of memory
  */
-void print_leak_report() {
-    // Your code here.
+void* darena_alloc(dmalloc_arena* arena, size_t sz, const char* file, long line) {
+    dmalloc_cache* cache = get_thread_cache();
+    // zero-byte objects still get a distinct address
+    size_t rounded = sz ? (sz + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1) : ARENA_ALIGN;
+    if (rounded < sz || size_t(arena->end - arena->next) < rounded) {
+        // move to the next existing chunk that fits, or add a new one
+        arena_chunk* chunk = arena->cur ? arena->cur->next : arena->chunks;
+        while (chunk && chunk->size < rounded) {
+            chunk = chunk->next;
+        }
+        if (!chunk) {
+            size_t chunk_size = std::max(rounded, ARENA_CHUNK_SIZE);
+            if (rounded < sz || chunk_size > SIZE_MAX - sizeof(arena_chunk)) {
+                record_failure(sz);
+                return nullptr;
+            }
+            chunk = reinterpret_cast<arena_chunk*>(internal_alloc(sizeof(arena_chunk) + chunk_size));
+            if (!chunk) {
+                record_failure(sz);
+                return nullptr;
+            }
+            // new chunks go right after the current one, so the chunks
+            // before `cur` are always the ones already used up
+            chunk->size = chunk_size;
+            chunk->file = file;
+            chunk->line = line;
+            if (arena->cur) {
+                chunk->next = arena->cur->next;
+                arena->cur->next = chunk;
+            } else {
+                chunk->next = arena->chunks;
+                arena->chunks = chunk;
+            }
+            uintptr_t lo = reinterpret_cast<uintptr_t>(chunk + 1);
+            update_heap_range(lo, lo + chunk_size);
+        }
+        arena_use_chunk(arena, chunk);
+    }
+    void* ptr = arena->next;
+    arena->next += rounded;
+    ++arena->nactive;
+    arena->active_size += sz;
+    stat_add(cache->stats.nalloc, 1);
+    stat_add(cache->stats.alloc_size, sz);
+    return ptr;
+}
+
+/**
+ * darena_reset(arena, file, line)
+ *      Free every object allocated from `arena` at once. The arena keeps its
+ *      chunks and reuses them for later allocations.
+ *
+ * @arg dmalloc_arena *arena : the arena to reset
+ * @arg const char *file : a string containing the filename from which darena_reset was called
+ * @arg long line : the line number from which darena_reset was called
+ */
+void darena_reset(dmalloc_arena* arena, const char* file, long line) {
+    dmalloc_cache* cache = get_thread_cache();
+    stat_add(cache->stats.nfree, arena->nactive);
+    stat_add(cache->stats.free_size, arena->active_size);
+    arena->nactive = arena->active_size = 0;
+    arena->reset_file = file;
+    arena->reset_line = line;
+    arena->cur = nullptr;
+    arena->next = arena->end = nullptr;
+}
+
+/**
+ * darena_destroy(arena, file, line)
+ *      Free every object allocated from `arena` and the arena itself. If
+ *      `arena` is a nullptr do nothing; if it is not a live arena, report a
+ *      memory bug at `file` and `line`.
+ *
+ * @arg dmalloc_arena *arena : the arena to destroy
+ * @arg const char *file : a string containing the filename from which darena_destroy was called
+ * @arg long line : the line number from which darena_destroy was called
+ */
+void darena_destroy(dmalloc_arena* arena, const char* file, long line) {
+    if (!arena) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(arenas_lock);
+        dmalloc_arena* a = arenas;
+        while (a && a != arena) {
+            a = a->next_arena;
+        }
+        if (!a) {
+            fprintf(stderr, "MEMORY BUG: %s: invalid destroy of arena %p, not an arena\n",
+                    site_name(file, line).text, static_cast<void*>(arena));
+            abort();
+        }
+        if (arena->prev_arena) {
+            arena->prev_arena->next_arena = arena->next_arena;
+        } else {
+            arenas = arena->next_arena;
+        }
+        if (arena->next_arena) {
+            arena->next_arena->prev_arena = arena->prev_arena;
+        }
+    }
+    darena_reset(arena, file, line);
+    while (arena_chunk* chunk = arena->chunks) {
+        arena->chunks = chunk->next;
+        base_free(chunk);
+    }
+    base_free(arena);
 }
@@ -45,6 +45,56 @@ void dfree(void* ptr, const char* file, long line);
  */
 void* dcalloc(size_t nmemb, size_t sz, const char* file, long line);
 
+/**
+ * drealloc(ptr, sz, file, line)
+ *      realloc() wrapper. Change the size of the block at `ptr` to `sz` bytes,
+ *      keeping its contents up to the smaller of the old and new sizes. The
+ *      block grows or shrinks in place when the underlying memory allows;
+ *      otherwise it moves and keeps its alignment. If `ptr` is a nullptr this
+ *      is dmalloc(sz); if `sz` is 0 the block is freed and nullptr returned.
+ *
+ * @arg void *ptr : a pointer to the heap, or nullptr
+ * @arg size_t sz : the new size in bytes
+ * @arg const char *file : a string containing the filename from which drealloc was called
+ * @arg long line : the line number from which drealloc was called
+ *
+ * @return a pointer to the resized block, or nullptr on failure (in which
+ *      case `ptr` is unchanged)
+ */
+void* drealloc(void* ptr, size_t sz, const char* file, long line);
+
+/**
+ * daligned_alloc(align, sz, file, line)
+ *      aligned_alloc() wrapper. Dynamically allocate `sz` bytes whose address
+ *      is a multiple of `align`. The block is freed with dfree.
+ *
+ * @arg size_t align : the alignment, a power of two
+ * @arg size_t sz : the amount of memory requested
+ * @arg const char *file : a string containing the filename from which daligned_alloc was called
+ * @arg long line : the line number from which daligned_alloc was called
+ *
+ * @return a pointer to the heap where the memory was reserved, or nullptr
+ *      if `align` is invalid (errno EINVAL, not counted as a failed
+ *      allocation) or memory is exhausted
+ */
+void* daligned_alloc(size_t align, size_t sz, const char* file, long line);
+
+/**
+ * dposix_memalign(memptr, align, sz, file, line)
+ *      posix_memalign() wrapper. Like daligned_alloc, but stores the block
+ *      in `*memptr`.
+ *
+ * @arg void **memptr : where to store the block
+ * @arg size_t align : the alignment, a power of two multiple of sizeof(void*)
+ * @arg size_t sz : the amount of memory requested
+ * @arg const char *file : a string containing the filename from which dposix_memalign was called
+ * @arg long line : the line number from which dposix_memalign was called
+ *
+ * @return 0 on success, EINVAL if `align` is invalid (not counted as a
+ *      failed allocation), or ENOMEM
+ */
+int dposix_memalign(void** memptr, size_t align, size_t sz, const char* file, long line);
+
 // struct to store global information about the dalloc functions
 struct dmalloc_stats {
     unsigned long long nactive;         // # active allocations
@@ -55,6 +105,15 @@ struct dmalloc_stats {
     unsigned long long fail_size;       // # bytes in failed alloc attempts
     uintptr_t heap_min;                 // smallest allocated addr
     uintptr_t heap_max;                 // largest allocated addr
+    // sampling mode (DMALLOC_SAMPLE_RATE); without sampling these equal
+    // ntotal, active_size and total_size
+    unsigned long long nsampled;        // # allocations tracked in full
+    unsigned long long sampled_active_size; // est. active bytes, from samples
+    unsigned long long sampled_total_size;  // est. total bytes, from samples
+    // base allocator fragmentation
+    unsigned long long nfree_blocks;    // # freed blocks held for reuse
+    unsigned long long free_size;       // # bytes in those blocks
+    unsigned long long slack_size;      // # bytes of live blocks beyond their request
 };
 
 /**
@@ -72,11 +131,213 @@ void get_statistics(dmalloc_stats* stats);
 void print_statistics();
 
 /**
- * print_leak_report()
+ * print_histograms()
+ *      Print histograms of request sizes, of allocation latency (dmalloc,
+ *      dcalloc, drealloc, daligned_alloc, dposix_memalign) and of dfree
+ *      latency, in TSC cycles, to stdout, merged over all threads.
+ *      Histograms are only collected when DMALLOC_HISTOGRAMS=1 is set in the
+ *      environment.
+ */
+void print_histograms();
+
+/**
+ * print_histograms_json(f)
+ *      Write the histograms printed by print_histograms() to `f` as a JSON
+ *      object: {"enabled": bool, "size": H, "malloc_latency": H,
+ *      "free_latency": H}, where each H is {"unit": string, "count": n,
+ *      "buckets": [{"min": lo, "max": hi, "count": n}, ...]} listing the
+ *      nonempty buckets in order; `min` and `max` are inclusive.
+ *
+ * @arg FILE *f : the stream to write to
+ */
+void print_histograms_json(FILE* f);
+
+/**
+ * print_leak_report(since)
  *      Print a report of all currently-active allocated blocks of dynamic
  *      memory.
+ *
+ * @arg unsigned since : if nonzero, only report blocks allocated after the
+ *      dmalloc_leak_checkpoint() call that returned `since`
+ */
+void print_leak_report(unsigned since = 0);
+
+/**
+ * print_leak_summary(since)
+ *      Print currently-active blocks grouped by allocation site, one line per
+ *      site, largest total size first. Memory use is bounded by the number of
+ *      sites, not the number of blocks.
+ *
+ * @arg unsigned since : as for print_leak_report()
+ */
+void print_leak_summary(unsigned since = 0);
+
+/**
+ * dmalloc_leak_checkpoint()
+ *      Start a new leak-check period. Passing the result to
+ *      print_leak_report() or print_leak_summary() limits them to blocks
+ *      allocated after this call.
+ *
+ * @return the new checkpoint, never 0
+ */
+unsigned dmalloc_leak_checkpoint();
+
+/**
+ * dmalloc_snapshot(name)
+ *      Record the currently-active blocks per allocation site under `name`,
+ *      replacing any earlier snapshot of that name. A snapshot holds one
+ *      entry per site with active blocks and is taken without walking the
+ *      heap, so it is cheap enough to take once per request.
+ *
+ * @arg const char *name : the snapshot's name (at most 63 characters kept)
+ */
+void dmalloc_snapshot(const char* name);
+
+/**
+ * print_snapshot_diff(from, to)
+ *      Print the change in active bytes and objects per allocation site
+ *      between snapshots `from` and `to`, largest growth first, leaving out
+ *      unchanged sites. If `to` is nullptr, compare `from` with the current
+ *      heap.
+ *
+ * @arg const char *from : the earlier snapshot
+ * @arg const char *to : the later snapshot, or nullptr
+ */
+void print_snapshot_diff(const char* from, const char* to = nullptr);
+
+/**
+ * dmalloc_set_stack_depth(depth)
+ *      Record the return addresses of up to `depth` callers (at most 16) for
+ *      each tracked allocation from now on, and print them under leak and
+ *      memory bug reports; 0 turns call stacks off. The default comes from
+ *      DMALLOC_STACKS and is 0.
+ *
+ * @arg unsigned depth : the number of frames to record
+ */
+void dmalloc_set_stack_depth(unsigned depth);
+
+/**
+ * dmalloc_check_range(ptr, len)
+ *      Check that all `len` bytes at `ptr` may be accessed, using the shadow
+ *      map enabled by DMALLOC_SHADOW=1: one shadow byte per 8 heap bytes
+ *      marking headers, padding, the slack after each payload, and freed
+ *      payloads as unaddressable. Prints a MEMORY BUG report to stderr naming
+ *      the first bad byte and returns false if any are unaddressable. Takes
+ *      O(len / 8) time. Always returns true without DMALLOC_SHADOW.
+ *
+ * @arg const void *ptr : the start of the access
+ * @arg size_t len : the number of bytes accessed
+ *
+ * @return true iff the access is valid
+ */
+bool dmalloc_check_range(const void* ptr, size_t len);
+
+/**
+ * dmalloc_check_heap()
+ *      Check every block in the heap in one pass in address order: each
+ *      dmalloc block's header must be consistent and each tracked block's
+ *      trailer canary intact. With DMALLOC_SHADOW=1 a block whose header has
+ *      been overwritten is reported too. Errors are printed to stderr; the
+ *      program keeps running. Results are exact only while no other thread
+ *      is allocating or freeing.
+ *
+ * @return the number of errors found
+ */
+size_t dmalloc_check_heap();
+
+/**
+ * dmalloc_start_scrubber(interval_ms, blocks_per_tick)
+ *      Start a low-priority background thread that checks the header and
+ *      trailer canary of `blocks_per_tick` tracked blocks (0 for the default
+ *      of 256) every `interval_ms` milliseconds, continuing where it left
+ *      off, and reports corruption with the block's allocation site as soon
+ *      as it finds it. Calling it again changes the settings. Setting
+ *      DMALLOC_SCRUB=ms (and optionally DMALLOC_SCRUB_BLOCKS=n) starts the
+ *      scrubber at the first allocation. Only tracked blocks are scrubbed:
+ *      with DMALLOC_SAMPLE_RATE set, the untracked blocks have no canary and
+ *      the scrubber never sees them.
+ *
+ * @arg unsigned interval_ms : the time between checks
+ * @arg size_t blocks_per_tick : the number of blocks checked each time
+ */
+void dmalloc_start_scrubber(unsigned interval_ms, size_t blocks_per_tick = 0);
+
+/**
+ * dmalloc_scrub(nblocks)
+ *      Run one scrubber step on the calling thread: check the next `nblocks`
+ *      tracked blocks (0 for the default of 256), continuing from where the
+ *      scrubber last stopped. Works whether or not the background scrubber
+ *      is running, and aborts on corruption just as it does.
+ *
+ * @arg size_t nblocks : the most blocks to check
+ * @return the number of blocks checked
+ */
+size_t dmalloc_scrub(size_t nblocks = 0);
+
+/**
+ * print_heavy_hitter_report()
+ *      Print the allocation sites responsible for the most allocated bytes,
+ *      largest first. Sites are found with a bounded-memory streaming top-k
+ *      summary; per-site byte and allocation counts come from the
+ *      allocation-site table.
+ */
+void print_heavy_hitter_report();
+
+// Arenas: bump-pointer allocation of many short-lived objects that are all
+// freed together.
+struct dmalloc_arena;
+
+/**
+ * darena_create(file, line)
+ *      Create an empty arena. Until it is destroyed, the arena appears in the
+ *      leak report as one record carrying `file` and `line`: its live
+ *      objects if it has any, otherwise the arena itself as undestroyed. The
+ *      record names the arena's last darena_reset and is followed by a line
+ *      for each chunk of memory, naming the darena_alloc call that added it.
+ *
+ * @arg const char *file : a string containing the filename from which darena_create was called
+ * @arg long line : the line number from which darena_create was called
+ *
+ * @return the new arena, or nullptr if out of memory
+ */
+dmalloc_arena* darena_create(const char* file, long line);
+
+/**
+ * darena_alloc(arena, sz, file, line)
+ *      Allocate `sz` bytes from `arena`, counted in the statistics like a
+ *      dmalloc() allocation. Objects are not freed individually. An arena must
+ *      only be used by one thread at a time.
+ *
+ * @arg dmalloc_arena *arena : the arena to allocate from
+ * @arg size_t sz : the amount of memory requested
+ * @arg const char *file : a string containing the filename from which darena_alloc was called
+ * @arg long line : the line number from which darena_alloc was called
+ *
+ * @return a pointer to the memory, or nullptr if out of memory
  */
-void print_leak_report();
+void* darena_alloc(dmalloc_arena* arena, size_t sz, const char* file, long line);
+
+/**
+ * darena_reset(arena, file, line)
+ *      Free every object allocated from `arena` at once, keeping its memory
+ *      for reuse.
+ *
+ * @arg dmalloc_arena *arena : the arena to reset
+ * @arg const char *file : a string containing the filename from which darena_reset was called
+ * @arg long line : the line number from which darena_reset was called
+ */
+void darena_reset(dmalloc_arena* arena, const char* file, long line);
+
+/**
+ * darena_destroy(arena, file, line)
+ *      Free every object allocated from `arena` and the arena itself.
+ *      Destroying something that is not a live arena is a memory bug.
+ *
+ * @arg dmalloc_arena *arena : the arena to destroy
+ * @arg const char *file : a string containing the filename from which darena_destroy was called
+ * @arg long line : the line number from which darena_destroy was called
+ */
+void darena_destroy(dmalloc_arena* arena, const char* file, long line);
 
 // these functions model the base functionality for malloc free and clalloc
 // `dmalloc.cc` should use these functions rather than malloc() and free().
@@ -84,16 +345,106 @@ void* base_malloc(size_t sz);
 void base_free(void* ptr);
 void base_allocator_disable(bool is_disabled);
 
+// Registry queries. `base_is_allocated` returns true iff `ptr` is the start
+// of a live base_malloc block, and `base_is_freed` iff it is the start of a
+// block that has been base_free()d (its memory is still intact).
+// `base_find_allocation` returns the start of the live block containing `ptr`
+// (storing its usable size in `*sz`), or nullptr. All are lock-free and never
+// allocate.
+bool base_is_allocated(const void* ptr);
+bool base_is_freed(const void* ptr);
+void* base_find_allocation(const void* ptr, size_t* sz);
+
+// `base_find_freed` is like `base_find_allocation` for blocks that have been
+// base_free()d but not yet reused.
+void* base_find_freed(const void* ptr, size_t* sz);
+
+// Returns true iff `base_malloc(sz)` would return a guarded block, one that
+// ends at a PROT_NONE page (DMALLOC_GUARD_THRESHOLD).
+bool base_guards(size_t sz);
+
+// Changes the size of the live block at `ptr` to `sz` without moving it.
+// Returns false, leaving the block unchanged, if `sz` exceeds its capacity.
+bool base_resize(void* ptr, size_t sz);
+
+// Calls `fn(ptr, sz, arg)` for every live base_malloc block in address
+// order, with `sz` its usable size. Holds all of the base allocator's heap
+// locks throughout, so `fn` must not allocate, free or take a lock that is
+// held around base allocator calls.
+void base_for_each_block(void (*fn)(void* ptr, size_t sz, void* arg), void* arg);
+
+// Fills the base allocator fragmentation fields of `stats`.
+void base_get_statistics(dmalloc_stats* stats);
+
+// Allocation sites are normally a file name and line. Callers that only know
+// a code address, like the operator new hooks in dmalloc_new.cc,
+// dbg_allocator and dbg_arena_allocator, pass `dmalloc_caller` as the file
+// and the address as the line; reports then print the address. The address
+// is the hook's own `__builtin_return_address(0)`, so a hook must not be
+// inlined into its caller or the site would name the caller's caller.
+extern const char dmalloc_caller[];
+
+// Per-thread cache size classes. A block of `n` bytes, header and trailer
+// included, is cached in class (n + 15) / 16 - 1 if that is below
+// DMALLOC_TCACHE_NBINS. dmalloc.cc checks these against its own layout; they
+// are here so dbg_allocator can pick a class at compile time.
+constexpr size_t DMALLOC_HEADER_SIZE = 64;
+constexpr size_t DMALLOC_TRAILER_SIZE = 8;
+constexpr size_t DMALLOC_TCACHE_STEP = 16;
+constexpr unsigned DMALLOC_TCACHE_NBINS = 64;
+constexpr unsigned DMALLOC_NO_SIZE_CLASS = 0xFFFF;
+
+/**
+ * dmalloc_size_class(sz, tracked)
+ *      Return the per-thread cache class of the block dmalloc(sz) uses, or
+ *      DMALLOC_NO_SIZE_CLASS if it is too large to be cached.
+ *
+ * @arg size_t sz : the amount of memory requested
+ * @arg bool tracked : whether the block is tracked in full, with a trailer
+ *      canary (always, unless DMALLOC_SAMPLE_RATE is set)
+ */
+constexpr unsigned dmalloc_size_class(size_t sz, bool tracked) {
+    size_t block_size = DMALLOC_HEADER_SIZE + (tracked ? DMALLOC_TRAILER_SIZE : 0);
+    if (sz > DMALLOC_TCACHE_STEP * DMALLOC_TCACHE_NBINS - block_size) {
+        return DMALLOC_NO_SIZE_CLASS;
+    }
+    return (block_size + sz + DMALLOC_TCACHE_STEP - 1) / DMALLOC_TCACHE_STEP - 1;
+}
+
+/**
+ * dmalloc_sized(sz, cls, tracked_cls, file, line)
+ *      dmalloc() for callers that know `sz` at compile time. `cls` and
+ *      `tracked_cls` must be dmalloc_size_class(sz, false) and
+ *      dmalloc_size_class(sz, true); passing them in lets dmalloc go straight
+ *      to the right per-thread cache bin.
+ *
+ * @arg size_t sz : the amount of memory requested
+ * @arg unsigned cls : the class of an untracked block of `sz` bytes
+ * @arg unsigned tracked_cls : the class of a tracked block of `sz` bytes
+ * @arg const char *file : a string containing the filename from which dmalloc_sized was called
+ * @arg long line : the line number from which dmalloc_sized was called
+ *
+ * @return a pointer to the heap where the memory was reserved
+ */
+void* dmalloc_sized(size_t sz, unsigned cls, unsigned tracked_cls, const char* file, long line);
+
 /// Preprocessor macros to override system versions with our versions.
 #if !DMALLOC_DISABLE
 #define malloc(sz)          dmalloc((sz), __FILE__, __LINE__)
 #define free(ptr)           dfree((ptr), __FILE__, __LINE__)
 #define calloc(nmemb, sz)   dcalloc((nmemb), (sz), __FILE__, __LINE__)
+#define realloc(ptr, sz)    drealloc((ptr), (sz), __FILE__, __LINE__)
+#define aligned_alloc(align, sz) daligned_alloc((align), (sz), __FILE__, __LINE__)
+#define posix_memalign(memptr, align, sz) \
+    dposix_memalign((memptr), (align), (sz), __FILE__, __LINE__)
 #endif
 
 
 /// This magic class lets standard C++ containers use your debugging allocator,
 /// instead of the system allocator. Don't worry about this
+///
+/// Single objects -- the nodes of std::map, std::list and friends -- take the
+/// dmalloc_sized() path with their size classes computed at compile time.
 template <typename T>
 class dbg_allocator {
 public:
@@ -102,12 +453,26 @@ public:
     dbg_allocator(const dbg_allocator<T>&) noexcept = default;
     template <typename U> dbg_allocator(dbg_allocator<U>&) noexcept {}
 
-    T* allocate(size_t n) {
-        return reinterpret_cast<T*>(dmalloc(n * sizeof(T), "?", 0));
+    __attribute__((noinline)) T* allocate(size_t n) {
+        long line = reinterpret_cast<long>(__builtin_return_address(0));
+        void* ptr;
+        if (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            ptr = daligned_alloc(alignof(T), n * sizeof(T), dmalloc_caller, line);
+        } else if (n == 1) {
+            ptr = dmalloc_sized(sizeof(T), object_class, tracked_object_class,
+                                dmalloc_caller, line);
+        } else {
+            ptr = dmalloc(n * sizeof(T), dmalloc_caller, line);
+        }
+        return reinterpret_cast<T*>(ptr);
     }
-    void deallocate(T* ptr, size_t) {
-        dfree(ptr, "?", 0);
+    __attribute__((noinline)) void deallocate(T* ptr, size_t) {
+        dfree(ptr, dmalloc_caller, reinterpret_cast<long>(__builtin_return_address(0)));
     }
+
+private:
+    static constexpr unsigned object_class = dmalloc_size_class(sizeof(T), false);
+    static constexpr unsigned tracked_object_class = dmalloc_size_class(sizeof(T), true);
 };
 template <typename T, typename U>
 inline constexpr bool operator==(const dbg_allocator<T>&, const dbg_allocator<U>&) {
@@ -118,4 +483,41 @@ inline constexpr bool operator!=(const dbg_allocator<T>&, const dbg_allocator<U>
     return false;
 }
 
+/// Like dbg_allocator, but allocates from a dmalloc_arena. Deallocation is a
+/// no-op; the memory is released when the arena is reset or destroyed.
+template <typename T>
+class dbg_arena_allocator {
+public:
+    using value_type = T;
+    explicit dbg_arena_allocator(dmalloc_arena* arena) noexcept : arena_(arena) {}
+    dbg_arena_allocator(const dbg_arena_allocator<T>&) noexcept = default;
+    template <typename U> dbg_arena_allocator(const dbg_arena_allocator<U>& other) noexcept
+        : arena_(other.arena()) {}
+
+    __attribute__((noinline)) T* allocate(size_t n) {
+        long line = reinterpret_cast<long>(__builtin_return_address(0));
+        void* ptr = darena_alloc(arena_, n * sizeof(T), dmalloc_caller, line);
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return reinterpret_cast<T*>(ptr);
+    }
+    void deallocate(T*, size_t) {
+    }
+    dmalloc_arena* arena() const noexcept {
+        return arena_;
+    }
+
+private:
+    dmalloc_arena* arena_;
+};
+template <typename T, typename U>
+inline bool operator==(const dbg_arena_allocator<T>& a, const dbg_arena_allocator<U>& b) {
+    return a.arena() == b.arena();
+}
+template <typename T, typename U>
+inline bool operator!=(const dbg_arena_allocator<T>& a, const dbg_arena_allocator<U>& b) {
+    return a.arena() != b.arena();
+}
+
 #endif
@@ -0,0 +1,143 @@
+#define DMALLOC_DISABLE 1
+#include "dmalloc.hh"
+#include <cstddef>
+#include <atomic>
+#include <new>
+
+// Replacements for the global operator new and delete, so allocations made
+// by the C++ library (containers, strings, std::function, ...) go through
+// dmalloc and appear in its statistics and leak reports. Link this file into
+// a program to opt in.
+//
+// dmalloc does not itself use operator new, but anything it calls might,
+// and an operator new reentered on the same thread must not recurse into
+// dmalloc. A reentered call is served from a small static bootstrap buffer
+// instead; its blocks are recognized by address and never freed. The guard is
+// a thread-local flag in the initial-exec TLS model -- a single %fs-relative
+// load and store per call, with no lock and no call into the TLS resolver.
+
+static constexpr size_t BOOTSTRAP_SIZE = 64 << 10;
+alignas(64) static char bootstrap[BOOTSTRAP_SIZE];
+static std::atomic<size_t> bootstrap_used;
+
+static thread_local bool in_new __attribute__((tls_model("initial-exec")));
+
+static void* bootstrap_alloc(size_t sz, size_t align) {
+    size_t pos = bootstrap_used.load(std::memory_order_relaxed);
+    size_t start;
+    do {
+        start = (pos + align - 1) & ~(align - 1);
+        if (start > BOOTSTRAP_SIZE || sz > BOOTSTRAP_SIZE - start) {
+            return nullptr;
+        }
+    } while (!bootstrap_used.compare_exchange_weak(pos, start + sz,
+                                                   std::memory_order_relaxed));
+    return bootstrap + start;
+}
+
+static bool is_bootstrap(void* ptr) {
+    return ptr >= bootstrap && ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+// Allocates `sz` bytes aligned to `align` (0 for the default alignment)
+// on behalf of code at `caller`. Returns nullptr on failure.
+static void* hook_alloc(size_t sz, size_t align, void* caller) {
+    if (in_new) {
+        return bootstrap_alloc(sz, align ? align : __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+    }
+    in_new = true;
+    long line = reinterpret_cast<long>(caller);
+    void* ptr = align ? daligned_alloc(align, sz, dmalloc_caller, line)
+        : dmalloc(sz, dmalloc_caller, line);
+    in_new = false;
+    return ptr;
+}
+
+// As hook_alloc, but runs the new-handler and throws std::bad_alloc on
+// failure, as the throwing forms of operator new must.
+static void* hook_alloc_or_throw(size_t sz, size_t align, void* caller) {
+    while (true) {
+        if (void* ptr = hook_alloc(sz, align, caller)) {
+            return ptr;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+static void hook_free(void* ptr, void* caller) {
+    if (!ptr || is_bootstrap(ptr)) {
+        return;
+    }
+    bool was_in_new = in_new;
+    in_new = true;
+    dfree(ptr, dmalloc_caller, reinterpret_cast<long>(caller));
+    in_new = was_in_new;
+}
+
+#define CALLER __builtin_return_address(0)
+
+void* operator new(size_t sz) {
+    return hook_alloc_or_throw(sz, 0, CALLER);
+}
+void* operator new[](size_t sz) {
+    return hook_alloc_or_throw(sz, 0, CALLER);
+}
+void* operator new(size_t sz, const std::nothrow_t&) noexcept {
+    return hook_alloc(sz, 0, CALLER);
+}
+void* operator new[](size_t sz, const std::nothrow_t&) noexcept {
+    return hook_alloc(sz, 0, CALLER);
+}
+void* operator new(size_t sz, std::align_val_t align) {
+    return hook_alloc_or_throw(sz, size_t(align), CALLER);
+}
+void* operator new[](size_t sz, std::align_val_t align) {
+    return hook_alloc_or_throw(sz, size_t(align), CALLER);
+}
+void* operator new(size_t sz, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return hook_alloc(sz, size_t(align), CALLER);
+}
+void* operator new[](size_t sz, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return hook_alloc(sz, size_t(align), CALLER);
+}
+
+void operator delete(void* ptr) noexcept {
+    hook_free(ptr, CALLER);
+}
+void operator delete[](void* ptr) noexcept {
+    hook_free(ptr, CALLER);
+}
+void operator delete(void* ptr, size_t) noexcept {
+    hook_free(ptr, CALLER);
+}
+void operator delete[](void* ptr, size_t) noexcept {
+    hook_free(ptr, CALLER);
+}
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    hook_free(ptr, CALLER);
+}
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    hook_free(ptr, CALLER);
+}
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    hook_free(ptr, CALLER);
+}
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    hook_free(ptr, CALLER);
+}
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    hook_free(ptr, CALLER);
+}
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+    hook_free(ptr, CALLER);
+}
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    hook_free(ptr, CALLER);
+}
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    hook_free(ptr, CALLER);
+}
@@ -0,0 +1,96 @@
+#ifndef __DMTRACE_HH
+#define __DMTRACE_HH 1
+#include <cstddef>
+#include <cstdint>
+
+// Binary allocation trace format, written by dmalloc when DMALLOC_TRACE is set
+// and read by `replay`.
+//
+// The file is memory-mapped and laid out as
+//
+//      [dmtrace_file_header][nslots fixed-size slots][site table]
+//
+// Each thread encodes its events into a private slot-sized buffer and copies
+// it to slot `seq % nslots` when it fills, so the slots form a ring: once it
+// wraps, the oldest slots are overwritten whole and every remaining slot can
+// still be decoded on its own. Slots are ordered by `seq`.
+//
+// Inside a slot, after its header, each event is an op byte followed by
+// LEB128 varints:
+//
+//      DMTRACE_MALLOC  time delta, size, site, zigzag(address delta)
+//      DMTRACE_FREE    time delta, zigzag(address delta)
+//
+// Time deltas are nanoseconds since the previous event in the slot (the
+// first is relative to `start_ns`); address deltas are relative to the
+// previous address in the slot (the first is relative to 0). `site` is 0 for
+// an unknown site, otherwise 1 + an index into the site table. The site
+// table, written at exit, is a sequence of dmtrace_site records each
+// followed by `name_len` bytes of file name.
+
+static constexpr char DMTRACE_MAGIC[8] = {'D', 'M', 'T', 'R', 'A', 'C', 'E', '1'};
+static constexpr uint32_t DMTRACE_SLOT_SIZE = 4096;
+
+struct dmtrace_file_header {
+    char magic[8];
+    uint32_t slot_size;
+    uint32_t nslots;
+    uint64_t sites_offset;          // file offset of the site table
+    uint64_t sites_size;            // # bytes of site table written
+};
+
+struct dmtrace_slot_header {
+    uint64_t seq;                   // 1 + sequence number; 0 if never written
+    uint64_t start_ns;
+    uint32_t thread;                // small per-thread id
+    uint32_t used;                  // # bytes of events after this header
+};
+
+struct dmtrace_site {
+    uint32_t index;
+    uint32_t name_len;
+    int64_t line;
+};
+
+enum dmtrace_op : uint8_t {
+    DMTRACE_MALLOC = 1,
+    DMTRACE_FREE = 2
+};
+
+// Worst-case encoded size of one event.
+static constexpr size_t DMTRACE_MAX_EVENT = 1 + 4 * 10;
+
+inline size_t dmtrace_put_varint(unsigned char* p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = uint8_t(v) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = uint8_t(v);
+    return n;
+}
+
+// Decodes a varint from [p, end). Returns the number of bytes read, or 0 if
+// the input is truncated.
+inline size_t dmtrace_get_varint(const unsigned char* p, const unsigned char* end,
+                                 uint64_t* v) {
+    uint64_t x = 0;
+    for (size_t n = 0; p + n != end && n != 10; ++n) {
+        x |= uint64_t(p[n] & 0x7F) << (7 * n);
+        if (!(p[n] & 0x80)) {
+            *v = x;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+inline uint64_t dmtrace_zigzag(int64_t x) {
+    return (uint64_t(x) << 1) ^ uint64_t(x >> 63);
+}
+
+inline int64_t dmtrace_unzigzag(uint64_t x) {
+    return int64_t(x >> 1) ^ -int64_t(x & 1);
+}
+
+#endif
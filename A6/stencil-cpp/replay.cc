@@ -0,0 +1,244 @@
+#define DMALLOC_DISABLE 1
+#include "dmalloc.hh"
+#include "dmtrace.hh"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+// Offline replay of a trace recorded with DMALLOC_TRACE (see dmtrace.hh).
+//
+// Decodes every slot, merges the per-thread event streams by timestamp, and
+// replays the allocations and frees single-threaded against the base
+// allocator or the system allocator, so changes to basealloc.cc can be
+// measured on a real workload without rerunning the program that produced
+// it. Frees of addresses whose allocation was lost when the ring wrapped are
+// skipped.
+//
+// usage: ./replay TRACEFILE [base|libc] [REPEAT]
+
+struct event {
+    uint64_t time;
+    uint64_t size;                  // 0 for a free
+    uintptr_t addr;
+    uint32_t site;
+    dmtrace_op op;
+};
+
+static bool decode_slot(const unsigned char* slot, uint32_t slot_size,
+                        std::vector<event>& events) {
+    auto* sh = reinterpret_cast<const dmtrace_slot_header*>(slot);
+    if (sh->used > slot_size - sizeof(dmtrace_slot_header)) {
+        return false;
+    }
+    const unsigned char* p = slot + sizeof(dmtrace_slot_header);
+    const unsigned char* end = p + sh->used;
+    uint64_t time = sh->start_ns;
+    uintptr_t addr = 0;
+    while (p != end) {
+        event e = {};
+        e.op = dmtrace_op(*p++);
+        if (e.op != DMTRACE_MALLOC && e.op != DMTRACE_FREE) {
+            return false;
+        }
+        uint64_t v;
+        size_t n;
+        if (!(n = dmtrace_get_varint(p, end, &v))) {
+            return false;
+        }
+        p += n;
+        time += v;
+        if (e.op == DMTRACE_MALLOC) {
+            if (!(n = dmtrace_get_varint(p, end, &e.size))) {
+                return false;
+            }
+            p += n;
+            if (!(n = dmtrace_get_varint(p, end, &v))) {
+                return false;
+            }
+            p += n;
+            e.site = v;
+        }
+        if (!(n = dmtrace_get_varint(p, end, &v))) {
+            return false;
+        }
+        p += n;
+        addr += dmtrace_unzigzag(v);
+        e.time = time;
+        e.addr = addr;
+        events.push_back(e);
+    }
+    return true;
+}
+
+static long peak_rss_kb() {
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+// Resets the process's peak RSS to its current RSS, where Linux allows it,
+// so the peak measured afterwards leaves out loading the trace. Returns the
+// peak to measure from.
+static long reset_peak_rss_kb() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0) {
+        ssize_t r = write(fd, "5", 1);
+        (void) r;
+        close(fd);
+    }
+    return peak_rss_kb();
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s TRACEFILE [base|libc] [REPEAT]\n", argv[0]);
+        return 2;
+    }
+    bool use_base = argc < 3 || strcmp(argv[2], "libc") != 0;
+    unsigned repeat = argc > 3 ? strtoul(argv[3], nullptr, 0) : 1;
+    if (repeat == 0) {
+        repeat = 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    auto* fh = reinterpret_cast<const dmtrace_file_header*>(map);
+    if (map == MAP_FAILED || size_t(st.st_size) < sizeof(*fh)
+        || memcmp(fh->magic, DMTRACE_MAGIC, sizeof(fh->magic)) != 0
+        || fh->slot_size < sizeof(dmtrace_slot_header)
+        || fh->sites_offset + fh->sites_size > uint64_t(st.st_size)
+        || sizeof(*fh) + uint64_t(fh->nslots) * fh->slot_size > fh->sites_offset) {
+        fprintf(stderr, "%s: not a dmalloc trace\n", argv[1]);
+        return 1;
+    }
+    const unsigned char* base = reinterpret_cast<const unsigned char*>(map);
+
+    // Collect written slots in sequence order and decode them.
+    std::vector<std::pair<uint64_t, const unsigned char*>> slots;
+    for (uint32_t i = 0; i != fh->nslots; ++i) {
+        const unsigned char* slot = base + sizeof(*fh) + size_t(i) * fh->slot_size;
+        uint64_t seq = reinterpret_cast<const dmtrace_slot_header*>(slot)->seq;
+        if (seq) {
+            slots.emplace_back(seq, slot);
+        }
+    }
+    std::sort(slots.begin(), slots.end());
+    bool wrapped = !slots.empty() && slots.front().first != 1;
+    std::vector<event> events;
+    size_t bad_slots = 0;
+    for (auto& s : slots) {
+        bad_slots += !decode_slot(s.second, fh->slot_size, events);
+    }
+    std::stable_sort(events.begin(), events.end(), [](const event& a, const event& b) {
+        return a.time < b.time;
+    });
+
+    size_t nsites = 0;
+    for (const unsigned char* p = base + fh->sites_offset,
+             *end = p + fh->sites_size;
+         size_t(end - p) >= sizeof(dmtrace_site); ++nsites) {
+        auto* rec = reinterpret_cast<const dmtrace_site*>(p);
+        p += sizeof(dmtrace_site) + rec->name_len;
+    }
+
+    printf("trace %s: %zu slots%s, %zu events, %zu sites", argv[1], slots.size(),
+           wrapped ? " (ring wrapped)" : "", events.size(), nsites);
+    if (bad_slots) {
+        printf(", %zu corrupt slots skipped", bad_slots);
+    }
+    printf("\n");
+    munmap(map, st.st_size);
+
+    // Replay.
+    void* (*do_malloc)(size_t) = use_base ? base_malloc : malloc;
+    void (*do_free)(void*) = use_base ? base_free : free;
+    struct replayed {
+        void* ptr;
+        size_t size;
+    };
+    std::unordered_map<uintptr_t, replayed> live;
+    live.reserve(events.size() / 2 + 1);
+    size_t nmalloc = 0, nfree = 0, nskipped = 0;
+    size_t live_bytes = 0, peak_live_bytes = 0;
+    long base_rss_kb = reset_peak_rss_kb();
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned r = 0; r != repeat; ++r) {
+        for (const event& e : events) {
+            if (e.op == DMTRACE_MALLOC) {
+                replayed& b = live[e.addr];
+                if (b.ptr) {
+                    // the free for the old block was lost
+                    do_free(b.ptr);
+                    live_bytes -= b.size;
+                }
+                b.ptr = do_malloc(e.size ? e.size : 1);
+                b.size = e.size;
+                live_bytes += e.size;
+                peak_live_bytes = std::max(peak_live_bytes, live_bytes);
+                ++nmalloc;
+            } else {
+                auto it = live.find(e.addr);
+                if (it == live.end()) {
+                    ++nskipped;
+                    continue;
+                }
+                do_free(it->second.ptr);
+                live_bytes -= it->second.size;
+                live.erase(it);
+                ++nfree;
+            }
+        }
+        if (r + 1 != repeat) {
+            for (auto& kv : live) {
+                do_free(kv.second.ptr);
+            }
+            live.clear();
+            live_bytes = 0;
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    // Fragmentation: bytes the allocator holds in free blocks relative to
+    // the bytes the program had live at the end of the trace.
+    size_t held_free;
+    if (use_base) {
+        dmalloc_stats stats;
+        base_get_statistics(&stats);
+        held_free = stats.free_size;
+    } else {
+        struct mallinfo2 mi = mallinfo2();
+        held_free = mi.fordblks;
+    }
+
+    printf("allocator %s, %u pass%s\n", use_base ? "base" : "libc", repeat,
+           repeat == 1 ? "" : "es");
+    printf("%zu mallocs, %zu frees, %zu unmatched frees skipped\n",
+           nmalloc, nfree, nskipped);
+    printf("%.3f sec, %.0f ops/sec\n", elapsed.count(),
+           (nmalloc + nfree) / elapsed.count());
+    printf("peak live %zu bytes, peak RSS %+ld KiB over the %ld KiB of the loaded trace\n",
+           peak_live_bytes, peak_rss_kb() - base_rss_kb, base_rss_kb);
+    printf("final live %zu bytes, %zu bytes free in allocator (%.1f%%)\n",
+           live_bytes, held_free,
+           live_bytes + held_free ? 100.0 * held_free / (live_bytes + held_free) : 0.0);
+
+    for (auto& kv : live) {
+        do_free(kv.second.ptr);
+    }
+}
@@ -0,0 +1,25 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Fragmentation statistics: freed blocks are held for reuse.
+
+int main() {
+    void* ptrs[10];
+    for (int i = 0; i != 10; ++i) {
+        ptrs[i] = malloc(3000);
+    }
+    for (int i = 0; i != 10; ++i) {
+        free(ptrs[i]);
+    }
+    dmalloc_stats stat;
+    get_statistics(&stat);
+    printf("free blocks %llu\n", stat.nfree_blocks);
+    assert(stat.free_size >= 10 * 3000);
+    assert(stat.slack_size == 0);
+    print_statistics();
+}
+
+//! free blocks 10
+//! alloc count: active          0   total         10   fail          0
+//! alloc size:  active          0   total      30000   fail          0
@@ -0,0 +1,24 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+// Sampling mode still reports exact counts and sizes.
+
+int main() {
+    setenv("DMALLOC_SAMPLE_RATE", "4096", 1);
+    void* ptrs[1000];
+    for (int i = 0; i != 1000; ++i) {
+        ptrs[i] = malloc(100);
+    }
+    for (int i = 0; i != 500; ++i) {
+        free(ptrs[i]);
+    }
+    dmalloc_stats stat;
+    get_statistics(&stat);
+    assert(stat.nsampled > 0 && stat.nsampled < 500);
+    print_statistics();
+}
+
+//! alloc count: active        500   total       1000   fail          0
+//! alloc size:  active      50000   total     100000   fail          0
+//! sampled:     count  ??{\s*\d+}??   est. active ??{\s*\d+}??   est. total ??{\s*\d+}??
@@ -0,0 +1,21 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Heavy-hitter report lists the sites with the most allocated bytes.
+
+int main() {
+    for (int i = 0; i != 100; ++i) {
+        void* small = malloc(8);
+        void* large = malloc(1000);
+        free(small);
+        free(large);
+    }
+    void* medium = malloc(5000);
+    print_heavy_hitter_report();
+    free(medium);
+}
+
+//! HEAVY HITTER: test???.cc:10: 100000 bytes in 100 allocations, 0 bytes active
+//! HEAVY HITTER: test???.cc:14: 5000 bytes in 1 allocations, 5000 bytes active
+//! HEAVY HITTER: test???.cc:9: 800 bytes in 100 allocations, 0 bytes active
@@ -0,0 +1,39 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+#include <csignal>
+#include <unistd.h>
+// Guard-page mode: a large block ends against an inaccessible page, so
+// running off its end faults immediately.
+
+static void on_fault(int) {
+    const char msg[] = "caught overrun\n";
+    ssize_t r = write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+    (void) r;
+    _exit(0);
+}
+
+int main() {
+    setenv("DMALLOC_GUARD_THRESHOLD", "4096", 1);
+    char* small = (char*) malloc(100);
+    char* big = (char*) malloc(10000);
+    for (int i = 0; i != 10000; ++i) {
+        big[i] = 1;
+    }
+    free(small);
+    free(big);
+    print_statistics();
+    fflush(stdout);
+
+    signal(SIGSEGV, on_fault);
+    big = (char*) malloc(8000);
+    for (volatile int i = 0; i != 10000; ++i) {
+        big[i] = 1;
+    }
+    printf("overrun not caught\n");
+}
+
+//! alloc count: active          0   total          2   fail          0
+//! alloc size:  active          0   total      10100   fail          0
+//! caught overrun
@@ -0,0 +1,35 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <vector>
+// Arena allocations are counted in the statistics and reported as one leak.
+
+int main() {
+    dmalloc_arena* arena = darena_create(__FILE__, __LINE__);
+    for (int i = 0; i != 100; ++i) {
+        char* p = (char*) darena_alloc(arena, 10, __FILE__, __LINE__);
+        assert((uintptr_t) p % alignof(double) == 0);
+        memset(p, i, 10);
+    }
+    std::vector<int, dbg_arena_allocator<int>> v{dbg_arena_allocator<int>(arena)};
+    v.reserve(20000);
+    print_statistics();
+    print_leak_report();
+
+    darena_reset(arena, __FILE__, __LINE__);
+    print_statistics();
+    print_leak_report();
+    darena_destroy(arena, __FILE__, __LINE__);
+}
+
+//! alloc count: active        101   total        101   fail          0
+//! alloc size:  active      81000   total      81000   fail          0
+//! LEAK CHECK: test???.cc:9: allocated arena ??{0x\w+}=arena?? with size 81000 in 101 objects
+//! LEAK CHECK: test???.cc:11: arena ??arena?? chunk ??{0x\w+}?? with size 65536
+//! LEAK CHECK: ??{0x\w+}??: arena ??arena?? chunk ??{0x\w+}?? with size 80000
+//! alloc count: active          0   total        101   fail          0
+//! alloc size:  active          0   total      81000   fail          0
+//! LEAK CHECK: test???.cc:9: undestroyed arena ??arena??, last reset at test???.cc:20
+//! LEAK CHECK: test???.cc:11: arena ??arena?? chunk ??{0x\w+}?? with size 65536
+//! LEAK CHECK: ??{0x\w+}??: arena ??arena?? chunk ??{0x\w+}?? with size 80000
@@ -0,0 +1,33 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Leak summary groups blocks by site, and checkpoints limit reports to
+// newer blocks.
+
+int main() {
+    for (int i = 0; i != 1000; ++i) {
+        (void) malloc(10);
+    }
+    for (int i = 0; i != 3; ++i) {
+        (void) malloc(5000);
+    }
+    unsigned checkpoint = dmalloc_leak_checkpoint();
+    assert(checkpoint != 0);
+    void* later = malloc(77);
+    void* freed = malloc(88);
+    free(freed);
+
+    print_leak_summary();
+    printf("since checkpoint\n");
+    print_leak_summary(checkpoint);
+    print_leak_report(checkpoint);
+    (void) later;
+}
+
+//! LEAK SUMMARY: test???.cc:13: 15000 bytes in 3 objects
+//! LEAK SUMMARY: test???.cc:10: 10000 bytes in 1000 objects
+//! LEAK SUMMARY: test???.cc:17: 77 bytes in 1 objects
+//! since checkpoint
+//! LEAK SUMMARY: test???.cc:17: 77 bytes in 1 objects
+//! LEAK CHECK: test???.cc:17: allocated object ??{0x\w+}?? with size 77
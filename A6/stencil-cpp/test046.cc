@@ -0,0 +1,49 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <cerrno>
+// Aligned allocation and realloc keep alignment, contents and statistics.
+
+int main() {
+    char* a = (char*) aligned_alloc(64, 100);
+    assert((uintptr_t) a % 64 == 0);
+    memset(a, 'a', 100);
+
+    void* b;
+    int r = posix_memalign(&b, 4096, 10);
+    assert(r == 0 && (uintptr_t) b % 4096 == 0);
+    assert(posix_memalign(&b, 12, 10) == EINVAL);
+    assert(aligned_alloc(3, 10) == nullptr);
+
+    // growing an aligned block keeps its alignment and contents
+    a = (char*) realloc(a, 10000);
+    assert((uintptr_t) a % 64 == 0);
+    for (int i = 0; i != 100; ++i) {
+        assert(a[i] == 'a');
+    }
+
+    // small growth fits in the slack of the underlying block
+    char* c = (char*) malloc(1000);
+    memset(c, 'c', 1000);
+    char* c2 = (char*) realloc(c, 1010);
+    assert(c2 == c);
+    c2[1009] = 'x';
+    c2 = (char*) realloc(c2, 20);
+    assert(c2 == c && c2[19] == 'c');
+
+    print_statistics();
+    print_leak_report();
+    free(a);
+    free(b);
+    free(c2);
+    print_statistics();
+}
+
+//! alloc count: active          3   total          6   fail          0
+//! alloc size:  active      10030   total      12140   fail          0
+//! LEAK CHECK: test???.cc:32: allocated object ??{0x\w+}?? with size 20
+//! LEAK CHECK: test???.cc:20: allocated object ??{0x\w+}?? with size 10000
+//! LEAK CHECK: test???.cc:14: allocated object ??{0x\w+}?? with size 10
+//! alloc count: active          0   total          6   fail          0
+//! alloc size:  active          0   total      12140   fail          0
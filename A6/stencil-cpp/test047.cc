@@ -0,0 +1,17 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Double free of an over-aligned block.
+
+int main() {
+    void* ptr = aligned_alloc(256, 2001);
+    fprintf(stderr, "Will free %p\n", ptr);
+    free(ptr);
+    free(ptr);
+    print_statistics();
+}
+
+//! Will free ??{0x\w+}=ptr??
+//! MEMORY BUG???: invalid free of pointer ??ptr??, double free
+//! ???
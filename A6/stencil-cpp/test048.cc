@@ -0,0 +1,15 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Wild write past the end of a block is caught by realloc.
+
+int main() {
+    char* ptr = (char*) malloc(100);
+    ptr[100] = 'x';
+    ptr = (char*) realloc(ptr, 50);
+    print_statistics();
+}
+
+//! MEMORY BUG???: detected wild write during realloc of pointer ???
+//! ???
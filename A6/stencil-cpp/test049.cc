@@ -0,0 +1,40 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+// With dmalloc_new.o linked in, C++ library allocations go through dmalloc
+// and are reported at the address that called operator new.
+
+int* leak;
+
+struct alignas(128) wide {
+    char data[128];
+};
+
+int main() {
+    {
+        std::vector<int> v;
+        for (int i = 0; i != 100; ++i) {
+            v.push_back(i);
+        }
+        std::map<int, std::string> m;
+        for (int i = 0; i != 10; ++i) {
+            m[i] = std::string(100, 'x');
+        }
+        wide* w = new wide;
+        assert((uintptr_t) w % 128 == 0);
+        delete w;
+    }
+    dmalloc_stats stats;
+    get_statistics(&stats);
+    assert(stats.ntotal > 20);
+    assert(stats.nactive == 0);
+
+    leak = new int[10];
+    print_leak_report();
+}
+
+//! LEAK CHECK: 0x??{\w+}??: allocated object ??{0x\w+}?? with size 40
@@ -0,0 +1,30 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <cstdlib>
+// DMALLOC_STACKS records the callers of each allocation and prints them
+// under its leak report line.
+
+__attribute__((noinline)) void* make_leak(size_t sz) {
+    void* ptr = malloc(sz);
+    asm volatile("" : : "r" (ptr) : "memory");
+    return ptr;
+}
+
+int main() {
+    setenv("DMALLOC_STACKS", "2", 1);
+    void* leaks[2];
+    for (int i = 0; i != 2; ++i) {
+        leaks[i] = make_leak(10);
+    }
+    (void) leaks;
+    print_leak_report();
+}
+
+//! LEAK CHECK: test???.cc:10: allocated object ??{0x\w+}?? with size 10
+//!     #0 ??{0x\w+}?? in make_leak(unsigned long)+??{0x\w+}??
+//!     #1 ??{0x\w+}?? in main+??{0x\w+}??
+//! LEAK CHECK: test???.cc:10: allocated object ??{0x\w+}?? with size 10
+//!     #0 ??{0x\w+}?? in make_leak(unsigned long)+??{0x\w+}??
+//!     #1 ??{0x\w+}?? in main+??{0x\w+}??
@@ -0,0 +1,29 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <cstdlib>
+// DMALLOC_HISTOGRAMS collects log-linear size and latency histograms.
+
+int main() {
+    setenv("DMALLOC_HISTOGRAMS", "1", 1);
+    for (int i = 0; i != 90; ++i) {
+        free(malloc(5));
+    }
+    for (int i = 0; i != 9; ++i) {
+        free(malloc(100));
+    }
+    free(malloc(5000));
+    print_histograms();
+    print_histograms_json(stdout);
+}
+
+//! HISTOGRAM size (bytes): 100 samples, p50 < 6, p90 < 6, p99 < 112
+//!            5 .. 5                  90  90.00%  90.00%
+//!           96 .. 111                 9   9.00%  99.00%
+//!         4096 .. 5119                1   1.00% 100.00%
+//! HISTOGRAM malloc_latency (cycles): 100 samples???
+//! ???
+//! HISTOGRAM free_latency (cycles): 100 samples???
+//! ???
+//! {"enabled": true, "size": {"unit": "bytes", "count": 100, "buckets": [{"min": 5, "max": 5, "count": 90}, {"min": 96, "max": 111, "count": 9}, {"min": 4096, "max": 5119, "count": 1}]}, "malloc_latency": {"unit": "cycles", "count": 100, ???}, "free_latency": {"unit": "cycles", "count": 100, ???}}
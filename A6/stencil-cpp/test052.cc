@@ -0,0 +1,49 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <cstdlib>
+// DMALLOC_SHADOW validates accesses against the shadow map, and
+// dmalloc_check_heap finds a smashed canary in one pass over the heap.
+
+int main() {
+    setenv("DMALLOC_SHADOW", "1", 1);
+    char* ptr = (char*) malloc(13);
+    assert(dmalloc_check_range(ptr, 13));
+    assert(dmalloc_check_range(ptr + 12, 1));
+    assert(!dmalloc_check_range(ptr + 8, 6));
+    assert(!dmalloc_check_range(ptr - 1, 2));
+
+    char* big = (char*) malloc(1000);
+    assert(dmalloc_check_range(big, 1000));
+    assert(!dmalloc_check_range(big, 1001));
+
+    char* aligned = (char*) aligned_alloc(256, 24);
+    assert(dmalloc_check_range(aligned, 24));
+    aligned = (char*) realloc(aligned, 8);
+    assert(dmalloc_check_range(aligned, 8));
+    assert(!dmalloc_check_range(aligned + 8, 1));
+
+    free(big);
+    assert(!dmalloc_check_range(big + 500, 4));
+
+    assert(dmalloc_check_heap() == 0);
+    char saved = ptr[13];
+    ptr[13] = 'x';
+    assert(dmalloc_check_heap() == 1);
+    ptr[13] = saved;
+    free(ptr);
+    free(aligned);
+    assert(dmalloc_check_heap() == 0);
+}
+
+//! MEMORY BUG: invalid access of 6 bytes at ??{0x\w+}??, heap buffer overflow at ??{0x\w+}??
+//! test???.cc:11: ??{0x\w+}?? is 13 bytes from the start of a 13 byte region allocated here
+//! MEMORY BUG: invalid access of 2 bytes at ??{0x\w+}??, heap buffer underflow at ??{0x\w+}??
+//! test???.cc:11: ??{0x\w+}?? is -1 bytes from the start of a 13 byte region allocated here
+//! MEMORY BUG: invalid access of 1001 bytes at ??{0x\w+}??, heap buffer overflow at ??{0x\w+}??
+//! test???.cc:17: ??{0x\w+}?? is 1000 bytes from the start of a 1000 byte region allocated here
+//! MEMORY BUG: invalid access of 1 bytes at ??{0x\w+}??, heap buffer overflow at ??{0x\w+}??
+//! test???.cc:23: ??{0x\w+}?? is 8 bytes from the start of a 8 byte region allocated here
+//! MEMORY BUG: invalid access of 4 bytes at ??{0x\w+}??, use after free at ??{0x\w+}??
+//! MEMORY BUG: test???.cc:11: detected wild write after pointer ??{0x\w+}??
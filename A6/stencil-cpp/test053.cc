@@ -0,0 +1,25 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// The scrubber finds a wild write while the block is still live.
+
+int main() {
+    void* ptrs[100];
+    for (int i = 0; i != 100; ++i) {
+        ptrs[i] = malloc(i + 1);
+    }
+    for (int i = 0; i != 100; i += 2) {
+        free(ptrs[i]);
+    }
+    char* victim = (char*) ptrs[51];
+    victim[52] = 'x';
+    // 50 live blocks, 4 per step: a full pass takes 13 steps
+    for (int i = 0; i != 13; ++i) {
+        dmalloc_scrub(4);
+    }
+    printf("not caught\n");
+}
+
+//! MEMORY BUG???: test???.cc:10: scrubber detected wild write after pointer ???
+//! ???
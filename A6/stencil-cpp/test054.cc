@@ -0,0 +1,40 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Heap snapshots and per-site diffs.
+
+static void* kept[100];
+
+int main() {
+    void* early = malloc(10);
+    dmalloc_snapshot("start");
+    for (int i = 0; i != 10; ++i) {
+        kept[i] = malloc(100);
+    }
+    void* temp = malloc(1000);
+    free(early);
+    dmalloc_snapshot("middle");
+    free(temp);
+    for (int i = 10; i != 15; ++i) {
+        kept[i] = malloc(20);
+    }
+    print_snapshot_diff("start", "middle");
+    print_snapshot_diff("middle");
+    dmalloc_snapshot("middle");
+    print_snapshot_diff("middle");
+    print_snapshot_diff("nonexistent", "middle");
+    for (int i = 0; i != 15; ++i) {
+        free(kept[i]);
+    }
+}
+
+//! SNAPSHOT DIFF start -> middle: +1990 bytes in +10 objects
+//! SNAPSHOT DIFF: test???.cc:13: +1000 bytes in +10 objects, now 1000 bytes in 10 objects
+//! SNAPSHOT DIFF: test???.cc:15: +1000 bytes in +1 objects, now 1000 bytes in 1 objects
+//! SNAPSHOT DIFF: test???.cc:10: -10 bytes in -1 objects, now 0 bytes in 0 objects
+//! SNAPSHOT DIFF middle -> (now): -900 bytes in +4 objects
+//! SNAPSHOT DIFF: test???.cc:20: +100 bytes in +5 objects, now 100 bytes in 5 objects
+//! SNAPSHOT DIFF: test???.cc:15: -1000 bytes in -1 objects, now 0 bytes in 0 objects
+//! SNAPSHOT DIFF middle -> (now): +0 bytes in +0 objects
+//! SNAPSHOT DIFF: no snapshot named nonexistent
@@ -0,0 +1,41 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <list>
+#include <map>
+// Node-based containers allocate one object at a time through the
+// compile-time size-class path; their blocks are reported at the address
+// that called the allocator.
+
+static_assert(dmalloc_size_class(1, false) == 4, "smallest untracked block");
+static_assert(dmalloc_size_class(1, true) == 4, "smallest tracked block");
+static_assert(dmalloc_size_class(952, true) == 63, "largest cached block");
+static_assert(dmalloc_size_class(953, true) == DMALLOC_NO_SIZE_CLASS, "uncached block");
+
+using int_map = std::map<int, int, std::less<int>,
+                         dbg_allocator<std::pair<const int, int>>>;
+
+int main() {
+    {
+        int_map m;
+        std::list<long, dbg_allocator<long>> l;
+        for (int round = 0; round != 3; ++round) {
+            for (int i = 0; i != 100; ++i) {
+                m[i] = i;
+                l.push_back(i);
+            }
+            m.clear();
+            l.clear();
+        }
+    }
+    print_statistics();
+
+    int* leak = dbg_allocator<int>().allocate(1);
+    *leak = 1;
+    print_leak_report();
+}
+
+//! alloc count: active          0   total        600   fail          0
+//! alloc size:  active          0   total  ??>=6000??   fail          0
+//! LEAK CHECK: 0x??{\w+}??: allocated object ??{0x\w+}?? with size 4
@@ -0,0 +1,21 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// A stale free after the freed block's size class is allocated again is
+// still a double free: freed blocks are not reused straight away.
+
+int main() {
+    void* ptr = malloc(32);
+    fprintf(stderr, "Will free %p\n", ptr);
+    free(ptr);
+    void* other = malloc(32);
+    assert(other != ptr);
+    free(ptr);
+    free(other);
+    print_statistics();
+}
+
+//! Will free ??{0x\w+}=ptr??
+//! MEMORY BUG???: invalid free of pointer ??ptr??, double free
+//! ???
@@ -0,0 +1,27 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Sites that do not fit in the site table share one "other sites" entry,
+// whose active counts must go back down when their blocks are freed.
+
+static void* ptrs[6000];
+
+int main() {
+    dmalloc_snapshot("before");
+    for (int i = 0; i != 6000; ++i) {
+        ptrs[i] = dmalloc(16, dmalloc_caller, 0x1000 + i);
+    }
+    for (int i = 0; i != 6000; ++i) {
+        dfree(ptrs[i], dmalloc_caller, 0x1000 + i);
+    }
+    print_snapshot_diff("before");
+    void* kept = dmalloc(16, dmalloc_caller, 0x1000);
+    dmalloc_snapshot("after");
+    print_snapshot_diff("before", "after");
+    dfree(kept, __FILE__, __LINE__);
+}
+
+//! SNAPSHOT DIFF before -> (now): +0 bytes in +0 objects
+//! SNAPSHOT DIFF before -> after: +16 bytes in +1 objects
+//! SNAPSHOT DIFF: 0x1000: +16 bytes in +1 objects, now 16 bytes in 1 objects
@@ -0,0 +1,29 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// A freed tracked block is reused from the thread's cache once enough later
+// frees have pushed it out of the thread's quarantine.
+
+int main() {
+    void* ptr = malloc(32);
+    void* others[256];
+    for (int i = 0; i != 256; ++i) {
+        others[i] = malloc(32);
+    }
+    free(ptr);
+    for (int i = 0; i != 255; ++i) {
+        free(others[i]);
+    }
+    void* again = malloc(32);
+    assert(again != ptr);
+    free(others[255]);
+    void* reused = malloc(32);
+    assert(reused == ptr);
+    free(again);
+    free(reused);
+    print_statistics();
+}
+
+//! alloc count: active          0   total        259   fail          0
+//! alloc size:  active          0   total       8288   fail          0
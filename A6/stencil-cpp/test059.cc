@@ -0,0 +1,34 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// With default settings, single objects allocated through dbg_allocator come
+// back from the thread cache's bin once they leave the quarantine.
+
+struct node {
+    node* left;
+    node* right;
+    long key;
+    long value;
+};
+
+int main() {
+    dbg_allocator<node> alloc;
+    node* first = alloc.allocate(1);
+    node* others[256];
+    for (int i = 0; i != 256; ++i) {
+        others[i] = alloc.allocate(1);
+    }
+    alloc.deallocate(first, 1);
+    for (int i = 0; i != 256; ++i) {
+        alloc.deallocate(others[i], 1);
+    }
+    // `first` left the quarantine on the last free and sits in its bin
+    node* reused = alloc.allocate(1);
+    assert(reused == first);
+    alloc.deallocate(reused, 1);
+    print_statistics();
+}
+
+//! alloc count: active          0   total        258   fail          0
+//! alloc size:  active          0   total       8256   fail          0
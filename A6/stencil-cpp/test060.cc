@@ -0,0 +1,16 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+// Destroying an arena twice is a memory bug.
+
+int main() {
+    dmalloc_arena* arena = darena_create(__FILE__, __LINE__);
+    darena_alloc(arena, 100, __FILE__, __LINE__);
+    darena_destroy(arena, __FILE__, __LINE__);
+    darena_destroy(arena, __FILE__, __LINE__);
+    printf("not caught\n");
+}
+
+//! MEMORY BUG???: test???.cc:11: invalid destroy of arena ??{0x\w+}??, not an arena
+//! ???
@@ -0,0 +1,39 @@
+#include "dmalloc.hh"
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <unistd.h>
+// Guard-page mode: a guarded block has no trailer, so a payload whose size
+// is a multiple of 16 ends exactly at the guard page and even a one-byte
+// overrun faults.
+
+static void on_fault(int) {
+    const char msg[] = "caught one-byte overrun\n";
+    ssize_t r = write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+    (void) r;
+    _exit(0);
+}
+
+int main() {
+    setenv("DMALLOC_GUARD_THRESHOLD", "4096", 1);
+    char* big = (char*) malloc(8000);
+    memset(big, 1, 8000);
+    big = (char*) realloc(big, 6000);
+    assert(big[5999] == 1);
+    free(big);
+    print_statistics();
+    fflush(stdout);
+
+    signal(SIGSEGV, on_fault);
+    big = (char*) malloc(8000);
+    memset(big, 1, 8000);
+    volatile char* p = big + 8000;
+    *p = 1;
+    printf("overrun not caught\n");
+}
+
+//! alloc count: active          0   total          2   fail          0
+//! alloc size:  active          0   total      14000   fail          0
+//! caught one-byte overrun